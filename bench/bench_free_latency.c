@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dyma.h"
+
+/*
+ * Measures the latency of dy_free on small blocks in a steady state, where bursts of frees keep
+ * filling the quick lists and forcing them to be flushed. Prints a histogram of free latencies
+ * (in power of two buckets) and its percentiles.
+ *
+ * Usage: bench_free_latency [operations] [coalesce batch]
+ */
+
+#define NUM_SLOTS 4096
+#define MAX_BURST 64
+#define MAX_SIZE 160
+#define NUM_BUCKETS 24
+
+static void *slots[NUM_SLOTS];
+static uint32_t *latencies;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char const *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : 1000000;
+    if (argc > 2) {
+        dy_mallopt(DY_OPT_COALESCE_BATCH, atol(argv[2]));
+    }
+    latencies = malloc(sizeof(uint32_t) * ops);
+    if (latencies == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    uint32_t seed = 1;
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        seed = seed * 1103515245 + 12345;
+        slots[i] = dy_malloc(1 + (seed >> 16) % MAX_SIZE);
+    }
+
+    // Free a burst of neighbouring slots, then allocate them again
+    long done = 0;
+    while (done < ops) {
+        seed = seed * 1103515245 + 12345;
+        int first = (seed >> 16) % NUM_SLOTS;
+        seed = seed * 1103515245 + 12345;
+        int burst = 1 + (seed >> 16) % MAX_BURST;
+        if (first + burst > NUM_SLOTS) {
+            burst = NUM_SLOTS - first;
+        }
+        for (int i = first; i < first + burst && done < ops; i++) {
+            uint64_t start = now_ns();
+            dy_free(slots[i]);
+            latencies[done++] = now_ns() - start;
+            slots[i] = NULL;
+        }
+        for (int i = first; i < first + burst; i++) {
+            if (slots[i] == NULL) {
+                seed = seed * 1103515245 + 12345;
+                slots[i] = dy_malloc(1 + (seed >> 16) % MAX_SIZE);
+            }
+        }
+    }
+
+    // Histogram of latencies, bucket i holds latencies in [2^i, 2^(i+1)) ns
+    long buckets[NUM_BUCKETS] = {0};
+    for (long i = 0; i < ops; i++) {
+        int bucket = latencies[i] ? 31 - __builtin_clz(latencies[i]) : 0;
+        buckets[bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1]++;
+    }
+    printf("%12s %10s\n", "free ns", "count");
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (buckets[i] > 0) {
+            printf("%5lu-%-6lu %10ld\n", 1UL << i, (2UL << i) - 1, buckets[i]);
+        }
+    }
+
+    qsort(latencies, ops, sizeof(uint32_t), compare_latency);
+    printf("p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n", latencies[ops / 2], latencies[(long)(ops * 0.99)],
+           latencies[(long)(ops * 0.999)], latencies[ops - 1]);
+    free(latencies);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dyma.h"
+
+/*
+ * Compares allocating many short-lived objects that all die together with dy_malloc and
+ * dy_free against allocating them from a region that is reset after each request.
+ *
+ * Usage: bench_region [requests] [objects per request]
+ */
+
+#define MAX_SIZE 128
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char const *argv[]) {
+    long requests = argc > 1 ? atol(argv[1]) : 2000;
+    long objects = argc > 2 ? atol(argv[2]) : 500;
+    void **ptrs = malloc(sizeof(void *) * objects);
+    if (ptrs == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // Per-object malloc and free
+    uint32_t seed = 1;
+    double start = now();
+    for (long r = 0; r < requests; r++) {
+        for (long i = 0; i < objects; i++) {
+            seed = seed * 1103515245 + 12345;
+            ptrs[i] = dy_malloc(1 + (seed >> 16) % MAX_SIZE);
+            if (ptrs[i] == NULL) {
+                fprintf(stderr, "dy_malloc failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+        for (long i = 0; i < objects; i++) {
+            dy_free(ptrs[i]);
+        }
+    }
+    double perObject = now() - start;
+
+    // Region allocation with one reset per request
+    seed = 1;
+    dy_region *region = dy_region_create(0);
+    start = now();
+    for (long r = 0; r < requests; r++) {
+        for (long i = 0; i < objects; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (dy_region_alloc(region, 1 + (seed >> 16) % MAX_SIZE) == NULL) {
+                fprintf(stderr, "dy_region_alloc failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+        dy_region_reset(region);
+    }
+    double perRegion = now() - start;
+    dy_region_destroy(region);
+
+    double total = (double)requests * objects;
+    printf("%-20s %10s %10s\n", "method", "ns/object", "speedup");
+    printf("%-20s %10.1f %10.2f\n", "dy_malloc/dy_free", perObject / total * 1e9, 1.0);
+    printf("%-20s %10.1f %10.2f\n", "region", perRegion / total * 1e9, perObject / perRegion);
+    free(ptrs);
+    return EXIT_SUCCESS;
+}
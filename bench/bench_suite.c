@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dyma.h"
+
+/*
+ * Runs synthetic workloads and replays malloc trace files against dyma and the system malloc,
+ * reporting throughput, per-operation latency percentiles and peak utilization (the most payload
+ * bytes live at once divided by the most heap bytes in use). Each run happens in a fresh process
+ * so that runs do not share heap state.
+ *
+ * Traces use the CS:APP malloc lab format: four header lines (suggested heap size, number of ids,
+ * number of operations, weight) followed by one operation per line, "a <id> <size>" to allocate,
+ * "r <id> <size>" to reallocate and "f <id>" to free.
+ *
+ * Usage: bench_suite [-n operations] [-a dyma|libc] [-p profile rate] [-f first|next|address|best] [-t] [trace files...]
+ *
+ * -f selects the placement policy dyma uses when scanning its free lists (first fit by default).
+ * -t prints the tracepoint summary to stderr after each dyma run (builds made with TRACE=1 or TRACE=log).
+ */
+
+// Allocator under test
+typedef struct allocator {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*memalign)(size_t size, size_t align);
+    size_t (*heap_size)();
+} allocator;
+
+static size_t dyma_heap_size() {
+    size_t size = 0;
+    for (int i = 0; i < DY_MEM_HEAPS; i++) {
+        if (dy_mem_heap_start(i) != NULL) {
+            size += dy_mem_heap_end(i) - dy_mem_heap_start(i);
+        }
+    }
+    return size;
+}
+
+static void *libc_memalign(size_t size, size_t align) {
+    void *ptr;
+    return posix_memalign(&ptr, align, size) ? NULL : ptr;
+}
+
+static size_t libc_heap_size() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static const allocator allocators[] = {
+    { "dyma", dy_malloc, dy_free, dy_realloc, dy_memalign, dyma_heap_size },
+    { "libc", malloc, free, realloc, libc_memalign, libc_heap_size },
+};
+
+// Measurements of one run, only touched by one thread at a time except for the latencies
+static const allocator *alloc;
+static uint32_t *latencies;
+static long num_latencies;
+static long max_latencies;
+static size_t live_bytes;
+static size_t peak_bytes;
+static size_t peak_heap;
+
+// Print the tracepoint summary after each dyma run
+static bool trace = false;
+
+// Names of the placement policies accepted by -f, indexed by DY_PLACE_*
+static const char *placements[] = { "first", "next", "address", "best" };
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void record(uint64_t start) {
+    uint64_t elapsed = now_ns() - start;
+    long i = __atomic_fetch_add(&num_latencies, 1, __ATOMIC_RELAXED);
+    if (i < max_latencies) {
+        latencies[i] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    }
+}
+
+// Track live payload bytes, sampling the heap size whenever a new peak is reached
+static void account(long delta) {
+    live_bytes += delta;
+    if (live_bytes > peak_bytes) {
+        peak_bytes = live_bytes;
+        size_t heap = alloc->heap_size();
+        if (heap > peak_heap) {
+            peak_heap = heap;
+        }
+    }
+}
+
+static void *timed_malloc(size_t size) {
+    uint64_t start = now_ns();
+    void *ptr = alloc->malloc(size);
+    record(start);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s: malloc(%zu) failed\n", alloc->name, size);
+        exit(EXIT_FAILURE);
+    }
+    // Touch the memory like a real program would
+    memset(ptr, 0xa5, size < 64 ? size : 64);
+    return ptr;
+}
+
+static void timed_free(void *ptr) {
+    uint64_t start = now_ns();
+    alloc->free(ptr);
+    record(start);
+}
+
+static void *timed_realloc(void *ptr, size_t size) {
+    uint64_t start = now_ns();
+    void *newPtr = alloc->realloc(ptr, size);
+    record(start);
+    if (newPtr == NULL) {
+        fprintf(stderr, "%s: realloc(%zu) failed\n", alloc->name, size);
+        exit(EXIT_FAILURE);
+    }
+    return newPtr;
+}
+
+static void *timed_memalign(size_t size, size_t align) {
+    uint64_t start = now_ns();
+    void *ptr = alloc->memalign(size, align);
+    record(start);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s: memalign(%zu, %zu) failed\n", alloc->name, size, align);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+// Allocate batches of blocks and free each batch in reverse order
+static void run_lifo(long ops) {
+    enum { BATCH = 512 };
+    void *ptrs[BATCH];
+    size_t sizes[BATCH];
+    uint32_t seed = 1;
+    for (long done = 0; done < ops; done += 2 * BATCH) {
+        for (int i = 0; i < BATCH; i++) {
+            sizes[i] = 8 + next_random(&seed) % 1024;
+            ptrs[i] = timed_malloc(sizes[i]);
+            account(sizes[i]);
+        }
+        for (int i = BATCH - 1; i >= 0; i--) {
+            timed_free(ptrs[i]);
+            account(-(long)sizes[i]);
+        }
+    }
+}
+
+// Allocate batches of blocks and free each batch in allocation order
+static void run_fifo(long ops) {
+    enum { BATCH = 512 };
+    void *ptrs[BATCH];
+    size_t sizes[BATCH];
+    uint32_t seed = 2;
+    for (long done = 0; done < ops; done += 2 * BATCH) {
+        for (int i = 0; i < BATCH; i++) {
+            sizes[i] = 8 + next_random(&seed) % 1024;
+            ptrs[i] = timed_malloc(sizes[i]);
+            account(sizes[i]);
+        }
+        for (int i = 0; i < BATCH; i++) {
+            timed_free(ptrs[i]);
+            account(-(long)sizes[i]);
+        }
+    }
+}
+
+// Keep a window of live blocks, freeing them in random order
+static void run_random(long ops) {
+    enum { WINDOW = 256 };
+    void *ptrs[WINDOW] = { NULL };
+    size_t sizes[WINDOW];
+    uint32_t seed = 3;
+    for (long i = 0; i < ops; i++) {
+        uint32_t r = next_random(&seed);
+        int slot = r % WINDOW;
+        if (ptrs[slot] != NULL) {
+            timed_free(ptrs[slot]);
+            account(-(long)sizes[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            // Mostly small blocks, with the occasional large one
+            sizes[slot] = (r >> 8) % 16 == 0 ? 1 + (r >> 12) % 8192 : 1 + (r >> 12) % 256;
+            ptrs[slot] = timed_malloc(sizes[slot]);
+            account(sizes[slot]);
+        }
+    }
+    for (int i = 0; i < WINDOW; i++) {
+        if (ptrs[i] != NULL) {
+            timed_free(ptrs[i]);
+        }
+    }
+}
+
+// Grow buffers with realloc, like a string builder or a growing vector
+static void run_realloc(long ops) {
+    enum { BUFFERS = 8, MAX_BUFFER = 1 << 16 };
+    void *ptrs[BUFFERS] = { NULL };
+    size_t sizes[BUFFERS] = { 0 };
+    uint32_t seed = 4;
+    for (long i = 0; i < ops; i++) {
+        int b = next_random(&seed) % BUFFERS;
+        if (ptrs[b] == NULL) {
+            sizes[b] = 16;
+            ptrs[b] = timed_malloc(sizes[b]);
+            account(sizes[b]);
+        } else if (sizes[b] >= MAX_BUFFER) {
+            timed_free(ptrs[b]);
+            account(-(long)sizes[b]);
+            ptrs[b] = NULL;
+        } else {
+            size_t size = sizes[b] + sizes[b] / 2;
+            ptrs[b] = timed_realloc(ptrs[b], size);
+            account(size - sizes[b]);
+            sizes[b] = size;
+        }
+    }
+    for (int b = 0; b < BUFFERS; b++) {
+        if (ptrs[b] != NULL) {
+            timed_free(ptrs[b]);
+        }
+    }
+}
+
+// Mix aligned and unaligned allocations in a window of live blocks
+static void run_memalign(long ops) {
+    enum { WINDOW = 64 };
+    void *ptrs[WINDOW] = { NULL };
+    size_t sizes[WINDOW];
+    uint32_t seed = 5;
+    for (long i = 0; i < ops; i++) {
+        uint32_t r = next_random(&seed);
+        int slot = r % WINDOW;
+        if (ptrs[slot] != NULL) {
+            timed_free(ptrs[slot]);
+            account(-(long)sizes[slot]);
+            ptrs[slot] = NULL;
+            continue;
+        }
+        sizes[slot] = 1 + (r >> 8) % 1024;
+        if ((r >> 20) % 2) {
+            ptrs[slot] = timed_memalign(sizes[slot], (size_t)16 << ((r >> 21) % 9));
+        } else {
+            ptrs[slot] = timed_malloc(sizes[slot]);
+        }
+        account(sizes[slot]);
+    }
+    for (int i = 0; i < WINDOW; i++) {
+        if (ptrs[i] != NULL) {
+            timed_free(ptrs[i]);
+        }
+    }
+}
+
+// Producer/consumer: one thread allocates, another frees, through a ring of slots
+enum { RING = 1024 };
+static void *ring[RING];
+static long ring_ops;
+
+static void *consumer(void *arg) {
+    for (long i = 0; i < ring_ops; i++) {
+        void *ptr;
+        while ((ptr = __atomic_load_n(&ring[i % RING], __ATOMIC_ACQUIRE)) == NULL) {
+            sched_yield();
+        }
+        __atomic_store_n(&ring[i % RING], NULL, __ATOMIC_RELEASE);
+        timed_free(ptr);
+    }
+    return NULL;
+}
+
+static void run_prodcons(long ops) {
+    ring_ops = ops / 2;
+    pthread_t thread;
+    pthread_create(&thread, NULL, consumer, NULL);
+    uint32_t seed = 6;
+    for (long i = 0; i < ring_ops; i++) {
+        void *ptr = timed_malloc(8 + next_random(&seed) % 512);
+        while (__atomic_load_n(&ring[i % RING], __ATOMIC_ACQUIRE) != NULL) {
+            sched_yield();
+        }
+        __atomic_store_n(&ring[i % RING], ptr, __ATOMIC_RELEASE);
+    }
+    pthread_join(thread, NULL);
+}
+
+// Replay a CS:APP style trace file
+static const char *trace_path;
+
+static void run_trace(long ops) {
+    FILE *file = fopen(trace_path, "r");
+    if (file == NULL) {
+        perror(trace_path);
+        exit(EXIT_FAILURE);
+    }
+    long heapSize, numIds, numOps, weight;
+    if (fscanf(file, "%ld %ld %ld %ld", &heapSize, &numIds, &numOps, &weight) != 4 || numIds <= 0) {
+        fprintf(stderr, "%s: bad trace header\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+    void **ptrs = calloc(numIds, sizeof(void *));
+    size_t *sizes = calloc(numIds, sizeof(size_t));
+    char op[2];
+    long id;
+    size_t size;
+    while (fscanf(file, "%1s %ld", op, &id) == 2) {
+        if (id < 0 || id >= numIds) {
+            fprintf(stderr, "%s: bad id %ld\n", trace_path, id);
+            exit(EXIT_FAILURE);
+        }
+        if (op[0] == 'f') {
+            if (ptrs[id] != NULL) {
+                timed_free(ptrs[id]);
+                account(-(long)sizes[id]);
+                ptrs[id] = NULL;
+            }
+            continue;
+        }
+        if (fscanf(file, "%zu", &size) != 1) {
+            fprintf(stderr, "%s: missing size for id %ld\n", trace_path, id);
+            exit(EXIT_FAILURE);
+        }
+        if (size == 0) {
+            size = 1;
+        }
+        if (op[0] == 'a') {
+            ptrs[id] = timed_malloc(size);
+        } else if (ptrs[id] != NULL) {
+            ptrs[id] = timed_realloc(ptrs[id], size);
+            account(-(long)sizes[id]);
+        } else {
+            ptrs[id] = timed_malloc(size);
+        }
+        sizes[id] = size;
+        account(size);
+    }
+    fclose(file);
+    for (long i = 0; i < numIds; i++) {
+        if (ptrs[i] != NULL) {
+            timed_free(ptrs[i]);
+        }
+    }
+    free(ptrs);
+    free(sizes);
+}
+
+typedef struct workload {
+    const char *name;
+    void (*run)(long ops);
+} workload;
+
+static const workload workloads[] = {
+    { "lifo", run_lifo },
+    { "fifo", run_fifo },
+    { "random", run_random },
+    { "prodcons", run_prodcons },
+    { "realloc", run_realloc },
+    { "memalign", run_memalign },
+};
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(double p) {
+    long n = num_latencies < max_latencies ? num_latencies : max_latencies;
+    if (n == 0) {
+        return 0;
+    }
+    long i = (long)(p * (n - 1));
+    return latencies[i];
+}
+
+// Run a workload in a child process and print its results
+static void run(const char *name, void (*fn)(long ops), const allocator *a, long ops) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid > 0) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("%-16s %-6s failed\n", name, a->name);
+        }
+        return;
+    }
+
+    alloc = a;
+    // Traces can be of any length, so make room for plenty of samples
+    max_latencies = ops * 4 + (1 << 20);
+    // Kept out of both allocators so it does not count towards their heaps
+    latencies = mmap(NULL, sizeof(uint32_t) * max_latencies, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (latencies == MAP_FAILED) {
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = now_ns();
+    fn(ops);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    qsort(latencies, num_latencies < max_latencies ? num_latencies : max_latencies, sizeof(uint32_t), compare_latency);
+    char util[16] = "-";
+    if (peak_heap > 0 && peak_bytes > 0) {
+        snprintf(util, sizeof(util), "%.1f%%", 100.0 * peak_bytes / peak_heap);
+    }
+    printf("%-16s %-6s %10ld %10.2f %8u %8u %8u %8s\n", name, a->name, num_latencies,
+           num_latencies / elapsed / 1e6, percentile(0.5), percentile(0.99), percentile(0.999), util);
+    if (trace && strcmp(a->name, "dyma") == 0) {
+        fflush(stdout);
+        if (dy_trace_dump(stderr)) {
+            fprintf(stderr, "dyma was built without tracepoints (make TRACE=1)\n");
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+    long ops = 1000000;
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:a:p:f:c:t")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = atol(optarg);
+                break;
+            case 'a':
+                only = optarg;
+                break;
+            case 'p':
+                dy_mallopt(DY_OPT_PROFILE_RATE, atol(optarg));
+                break;
+            case 'f':
+                for (int i = 0; i < (int)(sizeof(placements) / sizeof(placements[0])); i++) {
+                    if (strcmp(optarg, placements[i]) == 0) {
+                        dy_mallopt(DY_OPT_PLACEMENT, i);
+                    }
+                }
+                break;
+            case 'c':
+                dy_mallopt(DY_OPT_COALESCE_BATCH, atol(optarg));
+                break;
+            case 't':
+                trace = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n operations] [-a dyma|libc] [-p profile rate] [-f first|next|address|best] [-c coalesce batch] [-t] [trace files...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-16s %-6s %10s %10s %8s %8s %8s %8s\n", "workload", "alloc", "ops", "Mops/s",
+           "p50 ns", "p99 ns", "p99.9 ns", "util");
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+        if (only != NULL && strcmp(only, allocators[a].name) != 0) {
+            continue;
+        }
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            run(workloads[w].name, workloads[w].run, &allocators[a], ops);
+        }
+        for (int i = optind; i < argc; i++) {
+            trace_path = argv[i];
+            const char *name = strrchr(argv[i], '/');
+            run(name != NULL ? name + 1 : argv[i], run_trace, &allocators[a], ops);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dyma.h"
+
+/*
+ * Measures dy_malloc/dy_free throughput as the number of threads grows.
+ * Each thread churns a small window of live blocks with sizes in the quick list range.
+ *
+ * Usage: bench_threads [max threads] [operations per thread] [profile rate]
+ */
+
+#define WINDOW 32
+#define MAX_SIZE 128
+
+static long ops_per_thread = 1000000;
+
+static void *worker(void *arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+    void *slots[WINDOW] = { NULL };
+    for (long i = 0; i < ops_per_thread; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int slot = seed % WINDOW;
+        if (slots[slot] != NULL) {
+            dy_free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = dy_malloc(1 + (seed >> 8) % MAX_SIZE);
+            if (slots[slot] == NULL) {
+                fprintf(stderr, "dy_malloc failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    for (int i = 0; i < WINDOW; i++) {
+        if (slots[i] != NULL) {
+            dy_free(slots[i]);
+        }
+    }
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 32;
+    if (argc > 2) {
+        ops_per_thread = atol(argv[2]);
+    }
+    if (argc > 3) {
+        dy_mallopt(DY_OPT_PROFILE_RATE, atol(argv[3]));
+    }
+
+    printf("%8s %14s %14s\n", "threads", "Mops/s", "Mops/s/thread");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        pthread_t *threads = malloc(sizeof(pthread_t) * n);
+        double start = now();
+        for (int i = 0; i < n; i++) {
+            pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)i);
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double elapsed = now() - start;
+        double mops = (double)n * ops_per_thread / elapsed / 1e6;
+        printf("%8d %14.2f %14.2f\n", n, mops, mops / n);
+        free(threads);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,45 +1,217 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-int dy_errno;
+extern __thread int dy_errno;
 
 #define THIS_BLOCK_ALLOCATED  0x1
 #define PREV_BLOCK_ALLOCATED  0x2
 #define IN_QUICK_LIST         0x4
 
+#ifdef DY_COMPACT
+// Compact heaps (build with COMPACT=1): 4 byte headers and footers, and free list links stored as
+// 32-bit byte offsets from the start of the block's heap, so every heap must stay under 4GB
+typedef uint32_t dy_header;
+typedef uint32_t dy_footer;
+typedef uint32_t dy_link;
+#else
 typedef size_t dy_header;
 typedef size_t dy_footer;
+typedef struct dy_block *dy_link;
+#endif
 
 typedef struct dy_block {
     dy_header header;
     union {
         struct {
-            struct dy_block *next;
-            struct dy_block *prev;
+            dy_link next;
+            dy_link prev;
         } links;
         char payload[0];
     } body;
 } dy_block;
 
-#define NUM_QUICK_LISTS 20
-#define QUICK_LIST_MAX   5
-struct {
+#define NUM_QUICK_LISTS 21
+#define QUICK_LIST_MAX    5  // Initial capacity of a quick list
+#define QUICK_LIST_MIN    1  // Capacity of a quick list whose blocks are never reused
+#define QUICK_LIST_LIMIT  32 // Capacity of a quick list that keeps being refilled after flushes
+#define QUICK_LIST_WINDOW 64 // Number of frees to a quick list between capacity updates
+
+// Blocks kept when a full quick list is flushed, only the oldest quarter is returned to the free lists
+#define QUICK_LIST_KEEP(capacity) ((capacity) * 3 / 4)
+
+// Counters kept by each quick list, used to adapt its capacity
+typedef struct dy_quick_stats {
+    size_t hits;    // Allocations served from the list
+    size_t misses;  // Allocations of the list's size that found it empty
+    size_t refills; // Misses after the list had been flushed at least once
+    size_t frees;   // Blocks added to the list
+    size_t flushes; // Times the list was full and its oldest blocks were flushed to the free lists
+} dy_quick_stats;
+
+typedef struct dy_quick_list {
     int length;
+    int capacity; // Number of blocks the list holds before being flushed (0 until the thread first frees)
     struct dy_block *first;
-} dy_quick_lists[NUM_QUICK_LISTS];
+    dy_quick_stats stats;  // Totals since the thread started
+    dy_quick_stats window; // Totals when the capacity was last updated
+} dy_quick_list;
 
+// Quick lists are private to each thread, so they can be used without taking the heap lock
+extern __thread dy_quick_list dy_quick_lists[NUM_QUICK_LISTS];
+
+#ifdef DY_TLSF
+// Two-level segregated fit (build with FIT=tlsf): each power of two size range (first level)
+// is split into TLSF_SL_COUNT equal free lists (second level)
+#define TLSF_SL_LOG2 3
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT 25
+#define NUM_FREE_LISTS (TLSF_FL_COUNT * TLSF_SL_COUNT)
+#else
 #define NUM_FREE_LISTS 10
-struct dy_block dy_free_list_heads[NUM_FREE_LISTS];
+#endif
+
+#ifndef DY_NUM_ARENAS
+#define DY_NUM_ARENAS 8
+#endif
+
+// An independent heap with its own lock, prologue/epilogue and free lists
+typedef struct dy_arena {
+    pthread_mutex_t lock;
+    int initialized;
+    int heap;
+#ifdef DY_TLSF
+    unsigned int free_list_bitmap; // Bit i is set when any free list of first level i is non-empty
+    unsigned int sl_bitmaps[TLSF_FL_COUNT]; // Bit j of entry i is set when free list (i, j) is non-empty
+#else
+    unsigned int free_list_bitmap; // Bit i is set when free list i is non-empty
+#endif
+    void *base;                 // Start of the heap
+#ifdef DY_COMPACT
+    struct dy_block *free_list_heads; // Inside the prologue, so that blocks can link to them by offset
+#else
+    struct dy_block free_list_heads[NUM_FREE_LISTS];
+#endif
+    struct dy_block *tree_root; // Best fit tree of free blocks of at least tree_threshold bytes
+    struct dy_block *top;       // Free block at the end of the heap, kept out of the free lists, or NULL
+    size_t tree_threshold;      // Copied from the parameters when the heap is initialized, 0 if disabled
+    int placement;              // Placement policy for free list scans, copied when the heap is initialized
+    size_t fit_candidates;      // Fitting blocks compared by DY_PLACE_BEST_OF_N, copied with the policy
+    size_t coalesce_batch;      // Frees between coalescing sweeps, 0 to coalesce on every free, copied with the policy
+    size_t deferred_frees;      // Frees since the last coalescing sweep
+    struct dy_block *rovers[NUM_FREE_LISTS]; // Where the next scan of each free list starts with DY_PLACE_NEXT_FIT, NULL for its head
+    uint32_t fragments;                      // Row offset of the first fragment (free block too small for the free lists), 0 if none
+    size_t fragment_blocks;                  // Number of fragments
+    size_t free_list_blocks[NUM_FREE_LISTS]; // Number of blocks in each free list
+    size_t free_list_bytes[NUM_FREE_LISTS];  // Bytes in each free list
+    size_t free_bytes;                       // Bytes in all free lists, fragments and the top chunk
+    size_t heap_bytes;                       // Size of the heap
+    size_t peak_used_bytes;                  // Most bytes of the heap outside of free lists, as of the last unlock
+} dy_arena;
+
+extern dy_arena dy_arenas[DY_NUM_ARENAS];
+
+dy_arena *get_thread_arena();
+
+// Free lists of the arena assigned to the calling thread
+#define dy_free_list_heads (get_thread_arena()->free_list_heads)
 
 void *dy_malloc(size_t size);
 void *dy_realloc(void *ptr, size_t size);
 void dy_free(void *ptr);
 void *dy_memalign(size_t size, size_t align);
+size_t dy_malloc_batch(size_t size, size_t n, void *out[]);
+void dy_free_batch(void *ptrs[], size_t n);
+
+// Regions bump-allocate from large blocks and release everything at once
+typedef struct dy_region dy_region;
+
+dy_region *dy_region_create(size_t chunk_size);
+void *dy_region_alloc(dy_region *region, size_t size);
+void dy_region_reset(dy_region *region);
+void dy_region_destroy(dy_region *region);
+
+// Statistics returned by dy_stats, block sizes include their headers
+typedef struct dy_heap_stats {
+    size_t heap_bytes;         // Bytes in all heaps (arenas and slab pages)
+    size_t large_bytes;        // Bytes mapped for large blocks
+    size_t used_bytes;         // Bytes of the arena heaps not in free lists, plus large blocks
+    size_t peak_used_bytes;    // Sum of the most bytes used at once by each arena and by large blocks
+    size_t free_blocks;        // Blocks in the free lists, fragment lists and top chunks of all arenas
+    size_t free_bytes;
+    size_t largest_free_block;
+    size_t quick_blocks;       // Blocks cached in the quick lists of all threads
+    size_t quick_bytes;
+    size_t mallocs;            // Blocks allocated, including the moves made by dy_realloc
+    size_t frees;              // Blocks freed, including the moves made by dy_realloc
+    size_t reallocs;           // Calls to dy_realloc
+    double fragmentation;      // 1 - largest_free_block / free_bytes, or 0 without free bytes
+    size_t free_list_blocks[NUM_FREE_LISTS];
+    size_t free_list_bytes[NUM_FREE_LISTS];
+    size_t quick_list_blocks[NUM_QUICK_LISTS];
+    size_t quick_list_bytes[NUM_QUICK_LISTS];
+} dy_heap_stats;
+
+void dy_stats(dy_heap_stats *stats);
+
+// Heap consistency checking, and walking for tools (block states passed to the dy_heap_walk callback)
+#define DY_WALK_FREE      0
+#define DY_WALK_ALLOCATED 1
+#define DY_WALK_QUICK     2 // Allocated as far as the heap is concerned, but cached in a quick list
+
+int dy_heap_check();
+int dy_heap_walk(int (*callback)(void *ptr, size_t size, int state, void *arg), void *arg);
+
+// Sampling heap profiler, enabled with DY_OPT_PROFILE_RATE
+int dy_profile_dump(FILE *out);
+
+// Summary of the tracepoints, only available in builds made with TRACE=1 or TRACE=log
+int dy_trace_dump(FILE *out);
+
+// Parameters for dy_mallopt
+#define DY_OPT_GROW_PAGES   1   // Minimum number of pages to grow a heap by (default 1)
+#define DY_OPT_GROW_PERCENT 2   // Grow a heap by at least this percentage of its current size (default 0)
+#define DY_OPT_MMAP_THRESHOLD 3 // Requests of at least this many bytes get their own mapping, 0 to disable
+                                // (default 1MB with the mmap backend, disabled with the simulated one)
+#define DY_OPT_TREE_THRESHOLD 4 // Free blocks of at least this many bytes are found by best fit, 0 to disable (default 1024)
+#define DY_OPT_SLAB_MAX 5       // Requests of at most this many bytes (up to 64) are served from slab pages, 0 to disable (default 0)
+#define DY_OPT_QUICK_BUDGET 6   // Bytes that quick lists of all threads may cache beyond their initial capacity (default 1MB)
+#define DY_OPT_PROFILE_RATE 7   // Average bytes allocated between profiler samples, 0 to disable (default 0)
+#define DY_OPT_PLACEMENT 8      // Placement policy for free list scans, one of DY_PLACE_* (default DY_PLACE_FIRST_FIT)
+#define DY_OPT_FIT_CANDIDATES 9 // Fitting blocks compared by DY_PLACE_BEST_OF_N before taking the smallest (default 4)
+#define DY_OPT_COALESCE_BATCH 10 // Frees between sweeps coalescing an arena heap, 0 to coalesce on every free (default 0),
+                                 // only read when an arena is first used
+#define DY_OPT_TRIM_THRESHOLD 11 // Give the end of a heap back once a free grows its top chunk this many bytes past the top pad,
+                                 // 0 to disable (default 128KB)
+#define DY_OPT_TOP_PAD 12        // Bytes of the top chunk kept when the end of a heap is given back automatically (default 128KB)
+
+// Placement policies, only read when an arena is first used (large blocks in the best fit tree are not affected)
+#define DY_PLACE_FIRST_FIT   0 // First block that fits, most recently freed blocks first
+#define DY_PLACE_NEXT_FIT    1 // First block that fits, resuming each free list where its last scan stopped
+#define DY_PLACE_ADDRESS_FIT 2 // First block that fits, with each free list kept in address order
+#define DY_PLACE_BEST_OF_N   3 // Smallest of the first DY_OPT_FIT_CANDIDATES blocks that fit
+
+int dy_mallopt(int param, size_t value);
+int dy_trim(size_t pad);
+
+// One memory heap backs each arena, and one more holds the slab pages
+#define DY_MEM_HEAPS (DY_NUM_ARENAS + 1)
+#define DY_SLAB_HEAP DY_NUM_ARENAS
 
 void *dy_mem_start();
 void *dy_mem_end();
 void *dy_mem_grow();
+void *dy_mem_heap_start(int heap);
+void *dy_mem_heap_end(int heap);
+void *dy_mem_heap_grow(int heap, size_t pages);
+void dy_mem_heap_shrink(int heap, size_t pages);
+int dy_mem_heap_index(void *ptr);
+void dy_mem_release(void *ptr, size_t size);
+void *dy_mem_map(size_t size);
+void *dy_mem_remap(void *ptr, size_t old_size, size_t new_size);
+void dy_mem_unmap(void *ptr, size_t size);
 #define PAGE_SZ ((size_t)4096)
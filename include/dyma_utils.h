@@ -4,42 +4,356 @@
 #include <stdlib.h>
 #include "dyma.h"
 
-#define MIN_BLOCK_SIZE 32
 #define ROW_SIZE 8
+// Headers and footers take a row, or half of one in compact heaps. Blocks start HEADER_SIZE bytes
+// before a row boundary, so payloads are always 8 byte aligned.
+#define HEADER_SIZE sizeof(dy_header)
+#define FOOTER_SIZE sizeof(dy_footer)
+// Largest size a header can hold
+#define MAX_BLOCK_SIZE ((size_t)(dy_header)~(dy_header)0x7)
+
+#ifdef DY_COMPACT
+// Smallest block: a header, two 32-bit links and a footer once free, or 12 bytes of payload
+#define MIN_BLOCK_SIZE 16
+#define MIN_ALLOC_BLOCK_SIZE 16
+#else
+// Smallest block that can be in a free list: a header, two links and a footer
+#define MIN_BLOCK_SIZE 32
+// Smallest allocated block: allocated blocks have no footer, so a header and two rows of payload
+#define MIN_ALLOC_BLOCK_SIZE 24
+#endif
+
+// Free list links are pointers, or offsets from the start of the arena's heap in compact heaps
+#ifdef DY_COMPACT
+#define LINK_BLOCK(arena, link) ((dy_block *)((arena)->base + (link)))
+#define BLOCK_LINK(arena, bp) ((dy_link)((void *)(bp) - (arena)->base))
+#else
+#define LINK_BLOCK(arena, link) (link)
+#define BLOCK_LINK(arena, bp) (bp)
+#endif
+#define NULL_LINK ((dy_link)0)
+#define NEXT_FREE(arena, bp) LINK_BLOCK(arena, (bp)->body.links.next)
+#define PREV_FREE(arena, bp) LINK_BLOCK(arena, (bp)->body.links.prev)
+#define SET_NEXT_FREE(arena, bp, to) ((bp)->body.links.next = BLOCK_LINK(arena, to))
+#define SET_PREV_FREE(arena, bp, to) ((bp)->body.links.prev = BLOCK_LINK(arena, to))
+// Check if a free block is in a free list, the links of a block taken out of one are cleared
+#define IS_LINKED(bp) ((bp)->body.links.next != NULL_LINK && (bp)->body.links.prev != NULL_LINK)
+
+// Quick lists hold blocks of any arena, so they are linked by a pointer at the start of the payload
+#define QUICK_NEXT(bp) (*(struct dy_block **)(bp)->body.payload)
+
+// Each heap starts with an allocated prologue block, which holds the free list heads in compact heaps,
+// and ends with an epilogue header
+#define PROLOGUE(start) ((dy_block *)((void *)(start) + ROW_SIZE - HEADER_SIZE))
+#ifdef DY_COMPACT
+#define PROLOGUE_SIZE ((HEADER_SIZE + NUM_FREE_LISTS * sizeof(dy_block) + ROW_SIZE - 1) & ~(size_t)(ROW_SIZE - 1))
+#else
+#define PROLOGUE_SIZE ((size_t)MIN_BLOCK_SIZE)
+#endif
+#define FIRST_BLOCK(start) ((dy_block *)((void *)PROLOGUE(start) + PROLOGUE_SIZE))
+#define EPILOGUE(end) ((dy_block *)((void *)(end) - HEADER_SIZE))
+// Bytes of a heap taken by the padding before the prologue, the prologue and the epilogue
+#define HEAP_OVERHEAD (ROW_SIZE + PROLOGUE_SIZE)
+
+// Free blocks below MIN_BLOCK_SIZE (fragments) have no room for free list links. They are kept in a
+// list of their own instead, linked by row offsets from the start of their heap between header and footer.
+#define IS_FRAGMENT(size) ((size) < MIN_BLOCK_SIZE)
+
+typedef struct dy_fragment_links {
+    uint32_t next; // 0 at the end of the list (row 0 is the prologue)
+    uint32_t prev;
+} dy_fragment_links;
+
+#define FRAGMENT_LINKS(bp) ((dy_fragment_links *)(bp)->body.payload)
+
+// Size of the blocks held by quick list i
+#define QUICK_LIST_BLOCK_SIZE(i) (MIN_ALLOC_BLOCK_SIZE + (i) * ROW_SIZE)
+
+// Free blocks at least this large have their interior pages released to the memory backend
+#define RELEASE_THRESHOLD (PAGE_SZ * 64)
 
 #define GET_ALLOC(bp) (((bp)->header) & THIS_BLOCK_ALLOCATED)
 #define GET_PREV_ALLOC(bp) (((bp)->header) & PREV_BLOCK_ALLOCATED)
 #define GET_IN_QUICK_LIST(bp) (((bp)->header) & IN_QUICK_LIST)
 #define GET_SIZE(bp) (((bp)->header) & ~0x7)
-#define GET_FOOTER_PTR(bp) (((void *)bp + GET_SIZE(bp) - ROW_SIZE))
+#define GET_FOOTER_PTR(bp) (((void *)bp + GET_SIZE(bp) - FOOTER_SIZE))
 
+// The prev_alloc and quick list bits of a cached block may be updated concurrently by the
+// owning thread (without the heap lock) and by a neighbouring block's owner (with the lock),
+// so these bits are always updated atomically
 #define SET_ALLOC(bp) ((bp)->header |= THIS_BLOCK_ALLOCATED)
-#define SET_PREV_ALLOC(bp) ((bp)->header |= PREV_BLOCK_ALLOCATED)
-#define SET_IN_QUICK_LIST(bp) ((bp)->header |= IN_QUICK_LIST)
-#define SET_SIZE(bp, size) ((bp)->header = size | (bp->header & 0x7))
+#define SET_PREV_ALLOC(bp) ((void)__atomic_fetch_or(&(bp)->header, PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED))
+#define SET_IN_QUICK_LIST(bp) ((void)__atomic_fetch_or(&(bp)->header, IN_QUICK_LIST, __ATOMIC_RELAXED))
+#define SET_SIZE(bp, size) ((bp)->header = (size) | ((bp)->header & 0x7))
 
 #define CLEAR_HEADER(bp) ((bp)->header = 0)
 #define CLEAR_ALLOC(bp) ((bp)->header &= ~THIS_BLOCK_ALLOCATED)
-#define CLEAR_PREV_ALLOC(bp) ((bp)->header &= ~PREV_BLOCK_ALLOCATED)
-#define CLEAR_IN_QUICK_LIST(bp) ((bp)->header &= ~IN_QUICK_LIST)
+#define CLEAR_PREV_ALLOC(bp) ((void)__atomic_fetch_and(&(bp)->header, ~(dy_header)PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED))
+#define CLEAR_IN_QUICK_LIST(bp) ((void)__atomic_fetch_and(&(bp)->header, ~(dy_header)IN_QUICK_LIST, __ATOMIC_RELAXED))
 #define CLEAR_SIZE(bp) ((bp)->header &= 0x7)
 
+// Large blocks live in their own mappings, with this prefix just before the row holding their header
+typedef struct dy_large_prefix {
+    void *map;
+    size_t map_size;
+    size_t tag;
+} dy_large_prefix;
+
+// Free blocks in the best fit tree hold a tree node right after their free list links
+typedef struct dy_tree_node {
+    struct dy_block *left;
+    struct dy_block *right;
+    struct dy_block *parent;
+    size_t red;
+} dy_tree_node;
+
+#define TREE_NODE(bp) ((dy_tree_node *)((void *)(bp) + sizeof(dy_block)))
+// Smallest block with room for a tree node and a footer
+#define TREE_MIN_BLOCK_SIZE (sizeof(dy_block) + sizeof(dy_tree_node) + FOOTER_SIZE)
+// Check if a free block of the given size belongs in the tree of an arena
+#define IN_TREE(arena, size) ((arena)->tree_threshold != 0 && (size) >= (arena)->tree_threshold)
+
+#define LARGE_BLOCK_TAG ((size_t)0x646d61206c617267)
+#define LARGE_PREFIX(bp) ((dy_large_prefix *)((void *)(bp)->body.payload - ROW_SIZE - sizeof(dy_large_prefix)))
+// Only valid for pointers that passed check_pointer, anything outside of the heaps is a large block
+#define IS_LARGE_BLOCK(bp) (dy_mem_heap_index(bp) < 0)
+
+// Slab pages hold objects of one size class (multiples of ROW_SIZE up to SLAB_MAX_SIZE) after this header
+#define SLAB_MAX_SIZE 64
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / ROW_SIZE)
+#define SLAB_MAP_WORDS ((PAGE_SZ / ROW_SIZE + 63) / 64)
+
+typedef struct dy_slab_page {
+    size_t tag;
+    struct dy_slab_page *next;
+    struct dy_slab_page *prev;
+    size_t object_size;
+    size_t count;
+    size_t free_count;
+    uint64_t free_map[SLAB_MAP_WORDS]; // Bit i is set when object i is free
+} dy_slab_page;
+
+#define SLAB_PAGE_TAG ((size_t)0x646d6120736c6162)
+#define SLAB_OBJECTS_OFFSET ((sizeof(dy_slab_page) + 15) & ~(size_t)15)
+#define SLAB_PAGE(pp) ((dy_slab_page *)((uintptr_t)(pp) & ~(uintptr_t)(PAGE_SZ - 1)))
+#define IS_SLAB_POINTER(pp) (dy_mem_heap_index(pp) == DY_SLAB_HEAP)
+
+// Tunable parameters, set through dy_mallopt
+typedef struct dy_params {
+    size_t grow_pages;
+    size_t grow_percent;
+    size_t mmap_threshold;
+    size_t tree_threshold;
+    size_t slab_max;
+    size_t quick_budget;
+    size_t profile_rate;
+    int placement;
+    size_t fit_candidates;
+    size_t coalesce_batch;
+    size_t trim_threshold;
+    size_t top_pad;
+} dy_params;
+
+extern dy_params dy_config;
+
+#ifdef DY_TRACE
+// Tracepoints (make TRACE=1, or TRACE=log to also keep a log of each thread's recent events)
+#define TRACE_MALLOC_SLAB      0
+#define TRACE_MALLOC_LARGE     1
+#define TRACE_MALLOC_QUICK     2
+#define TRACE_MALLOC_FREE_LIST 3
+#define TRACE_MALLOC_HEAP      4
+#define TRACE_FREE_SLAB        5
+#define TRACE_FREE_LARGE       6
+#define TRACE_FREE_QUICK       7
+#define TRACE_FREE_FREE_LIST   8
+#define TRACE_TREE_SEARCH      9
+#define TRACE_LIST_SCAN        10
+#define TRACE_QUICK_FLUSH      11
+#define TRACE_COALESCE_SWEEP   12
+#define TRACE_NUM_TYPES        13
+
+// Free list scans are counted by the number of blocks looked at: 0, 1, 2-3, 4-7, ... and 1024 or more
+#define TRACE_SCAN_BUCKETS 12
+#define TRACE_BUCKET(n) ((n) == 0 ? 0 : (n) >= ((size_t)1 << (TRACE_SCAN_BUCKETS - 2)) ? TRACE_SCAN_BUCKETS - 1 \
+                         : 64 - __builtin_clzll(n))
+
+// Events recorded in the log of each thread before the oldest ones are overwritten
+#ifndef DY_TRACE_LOG_SIZE
+#define DY_TRACE_LOG_SIZE 4096
+#endif
+
+typedef struct dy_trace_counters {
+    size_t events[TRACE_NUM_TYPES];
+    size_t scans[TRACE_SCAN_BUCKETS];
+    size_t scanned; // Blocks looked at by free list scans
+    size_t flushed; // Blocks flushed from quick lists
+} dy_trace_counters;
+
+typedef struct dy_trace_event {
+    uint64_t time; // CLOCK_MONOTONIC, in nanoseconds
+    size_t type;
+    size_t arg;    // Block size of allocations and frees, blocks of scans and flushes, frees deferred by sweeps
+} dy_trace_event;
+#endif
+
+// Operation counters of a thread, only updated by the thread itself and aggregated by dy_stats
+typedef struct dy_thread_stats {
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+#ifdef DY_TRACE
+    dy_trace_counters trace;
+    dy_trace_event *trace_log; // Ring of the last DY_TRACE_LOG_SIZE events, mapped on first use
+    size_t trace_next;         // Number of events logged so far
+#endif
+    bool initialized;
+    dy_quick_list *quick_lists;
+    struct dy_thread_stats *next;
+    struct dy_thread_stats *prev;
+} dy_thread_stats;
+
+extern __thread dy_thread_stats dy_thread_counters;
+
+// Add n to a counter of the calling thread
+#define COUNT_STAT(field, n) do { \
+    if (!dy_thread_counters.initialized) { \
+        init_thread(); \
+    } \
+    __atomic_store_n(&dy_thread_counters.field, dy_thread_counters.field + (n), __ATOMIC_RELAXED); \
+} while (0)
+
+#ifdef DY_TRACE
+#define TRACE_ADD(field, n) \
+    __atomic_store_n(&dy_thread_counters.trace.field, dy_thread_counters.trace.field + (n), __ATOMIC_RELAXED)
+#ifdef DY_TRACE_LOG
+#define TRACE_LOG(type, arg) trace_log(type, arg)
+#else
+#define TRACE_LOG(type, arg)
+#endif
+// Record an event of the calling thread, the argument is only kept in the log
+#define TRACE(type, arg) do { \
+    TRACE_ADD(events[type], 1); \
+    TRACE_LOG(type, arg); \
+} while (0)
+// Record a free list scan that looked at n blocks
+#define TRACE_SCAN(n) do { \
+    TRACE_ADD(scans[TRACE_BUCKET(n)], 1); \
+    TRACE_ADD(scanned, n); \
+    TRACE(TRACE_LIST_SCAN, n); \
+} while (0)
+// Record a quick list flush returning n blocks to the free lists
+#define TRACE_FLUSH(n) do { \
+    TRACE_ADD(flushed, n); \
+    TRACE(TRACE_QUICK_FLUSH, n); \
+} while (0)
+
+void trace_log(size_t type, size_t arg);
+void add_trace_counters(dy_trace_counters *total, dy_trace_counters *counters);
+#else
+// Tracepoints are compiled out, scan lengths are only read to keep their counters used
+#define TRACE(type, arg)
+#define TRACE_SCAN(n) ((void)(n))
+#define TRACE_FLUSH(n) ((void)(n))
+#endif
+
+#ifdef DY_CHECK_INTERVAL
+// Canary builds (make CHECK=n) check the heaps every n allocations and frees of each thread
+#define CANARY_CHECK() do { \
+    if ((dy_thread_counters.mallocs + dy_thread_counters.frees) % DY_CHECK_INTERVAL == 0 && dy_heap_check()) { \
+        abort(); \
+    } \
+} while (0)
+#else
+#define CANARY_CHECK()
+#endif
+
+// Count down the bytes until the calling thread's next profiler sample
+#define PROFILE_MALLOC(pp, size) do { \
+    if ((dy_bytes_until_sample -= (long)(size)) < 0) { \
+        profile_sample(pp, size); \
+    } \
+} while (0)
+
+// Bucket of the profiler's table of live samples for an allocation
+#define PROFILE_BUCKET_BITS 12
+#define PROFILE_BUCKET(pp) ((size_t)(((uintptr_t)(pp) >> 4) * 0x9e3779b97f4a7c15ULL >> (64 - PROFILE_BUCKET_BITS)))
+
+// Whether an allocation may have been sampled, without taking the profile lock
+#define PROFILE_MARKED(pp) __atomic_load_n(&dy_profile_marks[PROFILE_BUCKET(pp)], __ATOMIC_RELAXED)
+
+// Forget a freed allocation if it may have been sampled
+#define PROFILE_FREE(pp) do { \
+    if (PROFILE_MARKED(pp)) { \
+        profile_free(pp); \
+    } \
+} while (0)
+
+// Follow an allocation that moved or changed size if it may have been sampled
+#define PROFILE_UPDATE(pp, new_pp, size) do { \
+    if (PROFILE_MARKED(pp)) { \
+        profile_update(pp, new_pp, size); \
+    } \
+} while (0)
+
+extern __thread long dy_bytes_until_sample;
+extern uint32_t dy_profile_marks[1 << PROFILE_BUCKET_BITS];
+
+void profile_sample(void *pp, size_t size);
+void profile_free(void *pp);
+void profile_update(void *pp, void *new_pp, size_t size);
+
+void init_thread();
+void register_thread_stats();
+void unregister_thread_stats();
+void for_each_thread_stats(void (*callback)(dy_thread_stats *stats, void *arg), void *arg);
+
 int calc_min_free_list_index(size_t size);
+int calc_free_list_index(size_t size);
+int find_free_list(dy_arena *arena, int index);
 int calc_quick_list_index(size_t size);
 size_t calc_block_size(size_t size);
+size_t calc_grow_pages(dy_arena *arena, size_t needed);
 
 dy_block* create_block(void *start, size_t size);
-void insert_block_free_list(dy_block *block);
+void insert_block_free_list(dy_arena *arena, dy_block *block);
+void remove_block_free_list(dy_arena *arena, dy_block *block);
 dy_block *split_block(dy_block *block, size_t size);
 void alloc_block(dy_block *block);
 void dealloc_block(dy_block *block);
-dy_block *coalesce_prev_block(dy_block *block);
+dy_block *coalesce_prev_block(dy_arena *arena, dy_block *block);
+dy_block *coalesce_next_block(dy_arena *arena, dy_block *block);
+void evict_quick_list(int index, int count);
 void flush_quick_list(int index);
 
-int init_heap();
+dy_arena *get_block_arena(dy_block *block);
+void lock_arena(dy_arena *arena);
+void unlock_arena(dy_arena *arena);
+
+int init_heap(dy_arena *arena);
 dy_block *get_quick_list_block(size_t block_size);
-dy_block *get_free_list_block(size_t block_size);
-dy_block *get_heap_block(size_t block_size);
+dy_block *get_free_list_block(dy_arena *arena, size_t block_size);
+dy_block *get_heap_block(dy_arena *arena, size_t block_size);
 int check_pointer(void *pp);
 int free_to_quick_list(dy_block *block);
-void free_to_free_list(dy_block *block);
\ No newline at end of file
+void free_to_free_list(dy_arena *arena, dy_block *block);
+int grow_block(dy_arena *arena, dy_block *block, size_t block_size);
+void shrink_block(dy_arena *arena, dy_block *block, size_t block_size);
+void coalesce_heap(dy_arena *arena);
+size_t trim_heap(dy_arena *arena, size_t pad);
+
+void tree_insert_block(dy_arena *arena, dy_block *block);
+void tree_remove_block(dy_arena *arena, dy_block *block);
+dy_block *tree_find_best_fit(dy_arena *arena, size_t size);
+
+void *get_slab_object(size_t size);
+void free_slab_object(void *pp);
+size_t get_slab_object_size(void *pp);
+int check_slab_pointer(void *pp);
+
+dy_block *get_large_block(size_t size, size_t align);
+size_t get_large_bytes();
+size_t get_peak_large_bytes();
+dy_block *resize_large_block(dy_block *block, size_t size);
+void free_large_block(dy_block *block);
+int check_large_block(dy_block *block);
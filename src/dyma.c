@@ -7,21 +7,26 @@
 
 #include "dyma_utils.h"
 
-/**
- * Allocates an uninitialized block of memory of a specified size in bytes.
- * @param size Size of memory to allocate in bytes.
- * @return If successful, a pointer to an uninitialized region of memory of the specified size
- *         If size is 0, then NULL is returned.
- *         If allocation fails, then NULL is returned and dy_errno is set to ENOMEM.
- */
-void *dy_malloc(size_t size) {
-    // Request size check
-    if (size == 0) {
-        return NULL;
+__thread int dy_errno;
+
+// Allocate a block from a slab page, its own mapping or the arena of the calling thread
+static void *allocate(size_t size) {
+    // Small requests are served from slab pages
+    if (size <= dy_config.slab_max) {
+        TRACE(TRACE_MALLOC_SLAB, size);
+        return get_slab_object(size);
+    }
+
+    // Large requests bypass the arenas and get their own mapping
+    if (dy_config.mmap_threshold && size >= dy_config.mmap_threshold) {
+        TRACE(TRACE_MALLOC_LARGE, size);
+        dy_block *block = get_large_block(size, ROW_SIZE);
+        return block == NULL ? NULL : block->body.payload;
     }
 
-    // Initialize heap (if not already initialized)
-    int result = init_heap();
+    // Initialize the heap of this thread's arena (if not already initialized)
+    dy_arena *arena = get_thread_arena();
+    int result = init_heap(arena);
     if (result) {
         return NULL;
     }
@@ -29,22 +34,24 @@ void *dy_malloc(size_t size) {
     // Calculate necessary block size
     size_t blockSize = calc_block_size(size);
 
-    // Check quick lists
+    // Check quick lists (thread local, no lock needed)
     dy_block *block = get_quick_list_block(blockSize);
     if (block != NULL) {
+        TRACE(TRACE_MALLOC_QUICK, blockSize);
         // Return pointer to payload
         return block->body.payload;
     }
 
-    // Check free lists
-    block = get_free_list_block(blockSize);
+    // Check free lists, then finally get a new block from the heap
+    lock_arena(arena);
+    block = get_free_list_block(arena, blockSize);
     if (block != NULL) {
-        // Return pointer to payload
-        return block->body.payload;
+        TRACE(TRACE_MALLOC_FREE_LIST, blockSize);
+    } else {
+        block = get_heap_block(arena, blockSize);
+        TRACE(TRACE_MALLOC_HEAP, blockSize);
     }
-
-    // Finally, get a new block from the heap
-    block = get_heap_block(blockSize);
+    unlock_arena(arena);
     if (block != NULL) {
         // Return pointer to payload
         return block->body.payload;
@@ -52,6 +59,28 @@ void *dy_malloc(size_t size) {
     return NULL;
 }
 
+/**
+ * Allocates an uninitialized block of memory of a specified size in bytes.
+ * @param size Size of memory to allocate in bytes.
+ * @return If successful, a pointer to an uninitialized region of memory of the specified size
+ *         If size is 0, then NULL is returned.
+ *         If allocation fails, then NULL is returned and dy_errno is set to ENOMEM.
+ */
+void *dy_malloc(size_t size) {
+    // Request size check
+    if (size == 0) {
+        return NULL;
+    }
+    CANARY_CHECK();
+
+    void *pp = allocate(size);
+    if (pp != NULL) {
+        COUNT_STAT(mallocs, 1);
+        PROFILE_MALLOC(pp, size);
+    }
+    return pp;
+}
+
 /**
  * Frees a previously block of allocated memory, allowing it to be reused.
  * @param ptr Pointer to block of memory.
@@ -63,16 +92,38 @@ void dy_free(void *pp) {
     if (check_pointer(pp)) {
         abort();
     }
+    COUNT_STAT(frees, 1);
+    CANARY_CHECK();
+    PROFILE_FREE(pp);
+
+    // Slab objects go back to their page
+    if (IS_SLAB_POINTER(pp)) {
+        TRACE(TRACE_FREE_SLAB, get_slab_object_size(pp));
+        free_slab_object(pp);
+        return;
+    }
+
+    // Large blocks are unmapped directly
+    dy_block *block = (dy_block *)((void *)pp - HEADER_SIZE);
+    if (IS_LARGE_BLOCK(block)) {
+        TRACE(TRACE_FREE_LARGE, GET_SIZE(block));
+        free_large_block(block);
+        return;
+    }
 
     // Attempt to add block to quick list
-    dy_block *block = (dy_block *)((void *)pp - ROW_SIZE);
     int result = free_to_quick_list(block);
     if (result == 0) {
+        TRACE(TRACE_FREE_QUICK, GET_SIZE(block));
         return;
     }
+    TRACE(TRACE_FREE_FREE_LIST, GET_SIZE(block));
 
-    // Attempt to add block to free list
-    free_to_free_list(block);
+    // Attempt to add block to the free list of the arena it came from
+    dy_arena *arena = get_block_arena(block);
+    lock_arena(arena);
+    free_to_free_list(arena, block);
+    unlock_arena(arena);
 }
 
 /**
@@ -91,6 +142,7 @@ void *dy_realloc(void *pp, size_t rsize) {
         dy_errno = EINVAL;
         return NULL;
     }
+    COUNT_STAT(reallocs, 1);
 
     // Zero size check
     if (rsize == 0) {
@@ -98,20 +150,68 @@ void *dy_realloc(void *pp, size_t rsize) {
         return NULL;
     }
 
+    // Slab objects stay put while the new size fits their size class, otherwise they are moved
+    if (IS_SLAB_POINTER(pp)) {
+        size_t objectSize = get_slab_object_size(pp);
+        if (rsize <= objectSize) {
+            return pp;
+        }
+        void *newPtr = dy_malloc(rsize);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        memcpy(newPtr, pp, objectSize);
+        dy_free(pp);
+        return newPtr;
+    }
+
     // Check the size of the current block
-    dy_block *block = ((void *)pp - ROW_SIZE);
+    dy_block *block = ((void *)pp - HEADER_SIZE);
     size_t blockSize = calc_block_size(rsize);
 
+    // Handle large blocks, which are remapped as long as they stay large
+    if (IS_LARGE_BLOCK(block)) {
+        if (dy_config.mmap_threshold && rsize >= dy_config.mmap_threshold) {
+            dy_block *newBlock = resize_large_block(block, rsize);
+            if (newBlock != NULL) {
+                PROFILE_UPDATE(pp, newBlock->body.payload, rsize);
+                return newBlock->body.payload;
+            }
+        }
+
+        // Otherwise move the data to a new block
+        void *newPtr = dy_malloc(rsize);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        size_t copySize = GET_SIZE(block) - HEADER_SIZE;
+        memcpy(newPtr, pp, copySize < rsize ? copySize : rsize);
+        dy_free(pp);
+        return newPtr;
+    }
+
     // Handle growing
     if (blockSize > GET_SIZE(block)) {
-        // Get new block
+        // Try to grow in place into the next block or new heap memory, unless the block should become large
+        if (!dy_config.mmap_threshold || rsize < dy_config.mmap_threshold) {
+            dy_arena *arena = get_block_arena(block);
+            lock_arena(arena);
+            int result = grow_block(arena, block, blockSize);
+            unlock_arena(arena);
+            if (result == 0) {
+                PROFILE_UPDATE(pp, pp, rsize);
+                return pp;
+            }
+        }
+
+        // Otherwise get new block
         void *newPtr = dy_malloc(rsize);
         if (newPtr == NULL) {
             return NULL;
         }
 
         // Copy data from old block to new block
-        memcpy(newPtr, pp, GET_SIZE(block) - ROW_SIZE);
+        memcpy(newPtr, pp, GET_SIZE(block) - HEADER_SIZE);
 
         // Free old block
         dy_free(pp);
@@ -122,13 +222,12 @@ void *dy_realloc(void *pp, size_t rsize) {
 
     // Handle shrinking
     if (blockSize < GET_SIZE(block)) {
-        // Split block
-        dy_block *newBlock = split_block(block, blockSize);
-
-        // If new block was created, add it to the free list
-        if (newBlock != NULL) {
-            free_to_free_list(newBlock);
-        }
+        // Split block, giving the remainder to the free list or to a free successor
+        dy_arena *arena = get_block_arena(block);
+        lock_arena(arena);
+        shrink_block(arena, block, blockSize);
+        unlock_arena(arena);
+        PROFILE_UPDATE(pp, pp, rsize);
 
         // Return pointer to old block
         return pp;
@@ -161,50 +260,314 @@ void *dy_memalign(size_t size, size_t align) {
         return NULL;
     }
 
+    // Large requests get their own mapping, aligned directly
+    // The aligned block must be at least MIN_BLOCK_SIZE, even for tiny requests
+    size_t alignedSize = size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
+    size_t paddedSize = alignedSize + align + MIN_BLOCK_SIZE + 8; // malloc already adds one +8
+    if (dy_config.mmap_threshold && paddedSize >= dy_config.mmap_threshold) {
+        dy_block *block = get_large_block(size, align);
+        if (block == NULL) {
+            return NULL;
+        }
+        COUNT_STAT(mallocs, 1);
+        PROFILE_MALLOC(block->body.payload, size);
+        return block->body.payload;
+    }
+
     // Allocate a block of size + align + min block size + header + footer
-    void *ptr = dy_malloc(size + align + MIN_BLOCK_SIZE + 8); // malloc already adds one +8
+    void *ptr = dy_malloc(paddedSize);
     if (ptr == NULL) {
         return NULL;
     }
 
+    // Get the block
+    dy_block *block = (dy_block *)((void *)ptr - HEADER_SIZE);
+    dy_arena *arena = get_block_arena(block);
+
     // Check if ptr is already aligned
+    lock_arena(arena);
     if ((uintptr_t)ptr % align == 0) {
         // Free the additional space
-        dy_block *block = (dy_block *)((void *)ptr - ROW_SIZE);
         size_t blockSize = calc_block_size(size);
         dy_block *splitBlock = split_block(block, blockSize);
         if (splitBlock != NULL) {
             // Free the new block
-            free_to_free_list(splitBlock);
+            free_to_free_list(arena, splitBlock);
         }
+        unlock_arena(arena);
+        PROFILE_UPDATE(ptr, ptr, size);
         return ptr;
     }
 
-    // Get the block
-    dy_block *block = (dy_block *)((void *)ptr - ROW_SIZE);
-
     // Find the first aligned address after the minimum block size
-    void *start = (void *)block + MIN_BLOCK_SIZE + ROW_SIZE;
+    void *start = (void *)block + MIN_BLOCK_SIZE + HEADER_SIZE;
     uintptr_t diff = (uintptr_t)start % align;
     void *aligned = start + (align - diff);
 
     // Split the block
-    dy_block *newBlock = split_block(block, (uintptr_t)aligned - (uintptr_t)block - ROW_SIZE);
+    dy_block *newBlock = split_block(block, (uintptr_t)aligned - (uintptr_t)block - HEADER_SIZE);
 
     // Mark the new block as allocated
     alloc_block(newBlock);
 
     // Free the old block
-    free_to_free_list(block);
+    free_to_free_list(arena, block);
 
     // Attempt to split the new block
     size_t blockSize = calc_block_size(size);
     dy_block *newNewBlock = split_block(newBlock, blockSize);
     if (newNewBlock != NULL) {
         // Free the new block
-        free_to_free_list(newNewBlock);
+        free_to_free_list(arena, newNewBlock);
     }
+    unlock_arena(arena);
+    PROFILE_UPDATE(ptr, aligned, size);
 
     // Return pointer to aligned block
     return aligned;
 }
+
+/**
+ * Allocates a number of uninitialized blocks of the same size, carving them out of a single free block
+ * or heap extension where possible.
+ *
+ * @param size Size of each block in bytes.
+ * @param n Number of blocks to allocate.
+ * @param out Array receiving a pointer to each block.
+ *
+ * @return The number of blocks allocated, which is less than n only if memory ran out (dy_errno is then set to ENOMEM).
+ *         If size is 0, then 0 is returned.
+ */
+size_t dy_malloc_batch(size_t size, size_t n, void *out[]) {
+    // Request size check
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+
+    // Slab objects and large blocks are allocated one by one
+    size_t blockSize = calc_block_size(size);
+    bool single = size <= dy_config.slab_max || (dy_config.mmap_threshold && size >= dy_config.mmap_threshold);
+    size_t done = 0;
+    if (!single && blockSize <= SIZE_MAX / n) {
+        dy_arena *arena = get_thread_arena();
+        if (init_heap(arena)) {
+            return 0;
+        }
+
+        // Get one block large enough for all of them
+        int savedErrno = dy_errno;
+        lock_arena(arena);
+        dy_block *block = get_free_list_block(arena, blockSize * n);
+        if (block == NULL) {
+            block = get_heap_block(arena, blockSize * n);
+        }
+        if (block != NULL) {
+            // Carve it up, the last block keeps any remainder too small to split off
+            size_t remaining = GET_SIZE(block);
+            for (; done < n - 1; done++) {
+                block->header &= PREV_BLOCK_ALLOCATED;
+                SET_SIZE(block, blockSize);
+                SET_ALLOC(block);
+                out[done] = block->body.payload;
+                remaining -= blockSize;
+                block = (void *)block + blockSize;
+                block->header = PREV_BLOCK_ALLOCATED;
+            }
+            SET_SIZE(block, remaining);
+            SET_ALLOC(block);
+            out[done++] = block->body.payload;
+            COUNT_STAT(mallocs, n);
+        } else {
+            // No room for all of them together, fall back to separate blocks
+            dy_errno = savedErrno;
+        }
+        unlock_arena(arena);
+        for (size_t i = 0; i < done; i++) {
+            PROFILE_MALLOC(out[i], size);
+        }
+    }
+
+    for (; done < n; done++) {
+        out[done] = dy_malloc(size);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    return done;
+}
+
+// Order pointers by address
+static int compare_pointers(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Frees a number of previously allocated blocks at once. Blocks that are next to each other are
+ * merged before being freed, so each run of adjacent blocks is coalesced and inserted only once.
+ *
+ * @param ptrs Array of pointers to blocks of memory, which is sorted by address in the process.
+ * @param n Number of pointers.
+ *
+ * If any pointer is invalid (or appears twice), abort() will be called to exit the program.
+ */
+void dy_free_batch(void *ptrs[], size_t n) {
+    // Check every pointer before freeing anything
+    for (size_t i = 0; i < n; i++) {
+        if (check_pointer(ptrs[i])) {
+            abort();
+        }
+    }
+    qsort(ptrs, n, sizeof(void *), compare_pointers);
+    for (size_t i = 1; i < n; i++) {
+        if (ptrs[i] == ptrs[i - 1]) {
+            abort();
+        }
+    }
+    CANARY_CHECK();
+
+    dy_arena *locked = NULL;
+    for (size_t i = 0; i < n; i++) {
+        dy_block *block = (dy_block *)(ptrs[i] - HEADER_SIZE);
+        // Slab objects and large blocks take the usual path (which may check every arena heap)
+        if (IS_SLAB_POINTER(ptrs[i]) || IS_LARGE_BLOCK(block)) {
+            if (locked != NULL) {
+                unlock_arena(locked);
+                locked = NULL;
+            }
+            dy_free(ptrs[i]);
+            continue;
+        }
+
+        // Merge the run of blocks starting here into one block
+        PROFILE_FREE(ptrs[i]);
+        size_t size = GET_SIZE(block);
+        size_t run = 1;
+        while (i + 1 < n && (void *)block + size == ptrs[i + 1] - HEADER_SIZE) {
+            PROFILE_FREE(ptrs[i + 1]);
+            size += GET_SIZE((dy_block *)(ptrs[i + 1] - HEADER_SIZE));
+            i++;
+            run++;
+        }
+        COUNT_STAT(frees, run);
+
+        // Single blocks take the usual path through the quick lists (which may lock arenas to flush)
+        if (run == 1 && calc_quick_list_index(size) != -1) {
+            if (locked != NULL) {
+                unlock_arena(locked);
+                locked = NULL;
+            }
+            if (free_to_quick_list(block) == 0) {
+                continue;
+            }
+        }
+
+        // Blocks are sorted, so all blocks of an arena come one after another
+        dy_arena *arena = get_block_arena(block);
+        if (arena != locked) {
+            if (locked != NULL) {
+                unlock_arena(locked);
+            }
+            lock_arena(arena);
+            locked = arena;
+        }
+        SET_SIZE(block, size);
+        free_to_free_list(arena, block);
+    }
+    if (locked != NULL) {
+        unlock_arena(locked);
+    }
+}
+
+/**
+ * Changes a tunable parameter of the allocator.
+ * Parameters apply to all arenas and should be set before other threads start allocating.
+ *
+ * @param param The parameter to change, one of the DY_OPT_* constants.
+ * @param value The new value for the parameter.
+ *
+ * @return If successful, 0 is returned.
+ *         If param is not a known parameter or value is out of range, then -1 is returned and dy_errno is set to EINVAL.
+ */
+int dy_mallopt(int param, size_t value) {
+    switch (param) {
+        case DY_OPT_GROW_PAGES:
+            if (value == 0) {
+                break;
+            }
+            dy_config.grow_pages = value;
+            return 0;
+        case DY_OPT_GROW_PERCENT:
+            dy_config.grow_percent = value;
+            return 0;
+        case DY_OPT_MMAP_THRESHOLD:
+            dy_config.mmap_threshold = value;
+            return 0;
+        case DY_OPT_SLAB_MAX:
+            if (value > SLAB_MAX_SIZE) {
+                break;
+            }
+            dy_config.slab_max = value;
+            return 0;
+        case DY_OPT_TREE_THRESHOLD:
+            if (value != 0 && value < TREE_MIN_BLOCK_SIZE) {
+                break;
+            }
+            dy_config.tree_threshold = value;
+            return 0;
+        case DY_OPT_QUICK_BUDGET:
+            dy_config.quick_budget = value;
+            return 0;
+        case DY_OPT_PROFILE_RATE:
+            dy_config.profile_rate = value;
+            return 0;
+        case DY_OPT_PLACEMENT:
+            if (value > DY_PLACE_BEST_OF_N) {
+                break;
+            }
+            dy_config.placement = value;
+            return 0;
+        case DY_OPT_FIT_CANDIDATES:
+            if (value == 0) {
+                break;
+            }
+            dy_config.fit_candidates = value;
+            return 0;
+        case DY_OPT_COALESCE_BATCH:
+            dy_config.coalesce_batch = value;
+            return 0;
+        case DY_OPT_TRIM_THRESHOLD:
+            dy_config.trim_threshold = value;
+            return 0;
+        case DY_OPT_TOP_PAD:
+            dy_config.top_pad = value;
+            return 0;
+    }
+    dy_errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Give the unused memory at the end of every arena heap back to the memory backend.
+ * The calling thread's quick lists are flushed first, so that their blocks can be coalesced.
+ *
+ * @param pad The number of free bytes to keep at the end of each heap for future allocations.
+ * @return 1 if any memory was given back, 0 otherwise.
+ */
+int dy_trim(size_t pad) {
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        flush_quick_list(i);
+    }
+
+    size_t released = 0;
+    for (int i = 0; i < DY_NUM_ARENAS; i++) {
+        dy_arena *arena = &dy_arenas[i];
+        lock_arena(arena);
+        if (arena->initialized) {
+            released += trim_heap(arena, pad);
+        }
+        unlock_arena(arena);
+    }
+    return released > 0;
+}
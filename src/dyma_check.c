@@ -0,0 +1,261 @@
+#include "dyma_utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dyma.h"
+
+/*
+ * The heap checker walks every arena heap from the prologue to the epilogue in a single pass,
+ * then follows the free lists and the best fit tree and compares what it found with the walk.
+ * It allocates nothing and only reads the heaps, so it can be run periodically (see CHECK in the
+ * Makefile). Each arena is locked while it is checked, and only the calling thread's quick lists
+ * can be checked, as other threads update theirs without a lock.
+ */
+
+// Report the first problem found and fail the check
+#define CHECK_FAIL(...) do { \
+    fprintf(stderr, "dy_heap_check: " __VA_ARGS__); \
+    fputc('\n', stderr); \
+    return -1; \
+} while (0)
+
+// Count the nodes of a subtree of the best fit tree, checking their order and parent links
+static long count_tree_nodes(dy_block *node, dy_block *parent) {
+    if (node == NULL) {
+        return 0;
+    }
+    dy_tree_node *tn = TREE_NODE(node);
+    if (tn->parent != parent || GET_ALLOC(node)) {
+        return -1;
+    }
+    if ((tn->left != NULL && GET_SIZE(tn->left) > GET_SIZE(node)) ||
+        (tn->right != NULL && GET_SIZE(tn->right) < GET_SIZE(node))) {
+        return -1;
+    }
+    long left = count_tree_nodes(tn->left, node);
+    long right = count_tree_nodes(tn->right, node);
+    if (left < 0 || right < 0) {
+        return -1;
+    }
+    return left + right + 1;
+}
+
+// Check the heap and free lists of an arena (arena lock must be held)
+static int check_arena(dy_arena *arena) {
+    void *start = dy_mem_heap_start(arena->heap);
+    void *end = dy_mem_heap_end(arena->heap);
+    dy_block *epilogue = EPILOGUE(end);
+
+    dy_block *prologue = PROLOGUE(start);
+    if (!GET_ALLOC(prologue) || GET_SIZE(prologue) != PROLOGUE_SIZE) {
+        CHECK_FAIL("arena %d: bad prologue at %p", arena->heap, prologue);
+    }
+
+    // Walk every block, checking its size, footer and prev_alloc bit
+    size_t freeBlocks = 0;
+    size_t freeBytes = 0;
+    size_t treeBlocks = 0;
+    size_t fragments = 0;
+    bool prevAlloc = true;
+    dy_block *last = NULL;
+    dy_block *block = FIRST_BLOCK(start);
+    while (block != epilogue) {
+        size_t size = GET_SIZE(block);
+        if (size < MIN_ALLOC_BLOCK_SIZE || size % ROW_SIZE != 0 || (void *)block + size > (void *)epilogue) {
+            CHECK_FAIL("arena %d: block %p has bad size %zu", arena->heap, block, size);
+        }
+        if (!GET_PREV_ALLOC(block) != !prevAlloc) {
+            CHECK_FAIL("arena %d: block %p has prev_alloc %d, previous block is %s", arena->heap, block,
+                       !!GET_PREV_ALLOC(block), prevAlloc ? "allocated" : "free");
+        }
+        if (GET_ALLOC(block)) {
+            prevAlloc = true;
+        } else {
+            if (GET_IN_QUICK_LIST(block)) {
+                CHECK_FAIL("arena %d: free block %p is marked as in a quick list", arena->heap, block);
+            }
+            if (!prevAlloc && arena->coalesce_batch == 0) {
+                CHECK_FAIL("arena %d: free block %p follows another free block", arena->heap, block);
+            }
+            dy_footer footer = *(dy_footer *)GET_FOOTER_PTR(block);
+            if ((footer & ~0x7) != size || (footer & THIS_BLOCK_ALLOCATED)) {
+                CHECK_FAIL("arena %d: free block %p has size %zu but footer %#zx", arena->heap, block, size, (size_t)footer);
+            }
+            prevAlloc = false;
+            freeBytes += size;
+            if (block == arena->top) {
+                // Checked against the last block below
+            } else if (IS_FRAGMENT(size)) {
+                fragments++;
+            } else {
+                freeBlocks++;
+            }
+            if (IN_TREE(arena, size) && block != arena->top) {
+                treeBlocks++;
+            }
+        }
+        last = block;
+        block = (void *)block + size;
+    }
+    if (!GET_ALLOC(epilogue) || GET_SIZE(epilogue) != 0 || !GET_PREV_ALLOC(epilogue) != !prevAlloc) {
+        CHECK_FAIL("arena %d: bad epilogue at %p", arena->heap, epilogue);
+    }
+
+    // A free block at the end of the heap is the top chunk, and is the only free block outside of the free lists
+    if (arena->top != (prevAlloc ? NULL : last)) {
+        CHECK_FAIL("arena %d: top chunk is %p but the heap ends with %s block %p", arena->heap, arena->top,
+                   prevAlloc ? "an allocated" : "a free", last);
+    }
+
+    // Every block in the free lists must be a free block of the list's size class, in this heap
+    size_t maxBlocks = (end - start) / MIN_BLOCK_SIZE;
+    size_t listedBlocks = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        dy_block *head = &arena->free_list_heads[i];
+        size_t count = 0;
+        bool roverListed = arena->rovers[i] == NULL;
+        for (dy_block *bp = NEXT_FREE(arena, head); bp != head; bp = NEXT_FREE(arena, bp)) {
+            if (bp < FIRST_BLOCK(start) || bp >= epilogue || ++count > maxBlocks) {
+                CHECK_FAIL("arena %d: free list %d links to %p outside of the heap or loops", arena->heap, i, bp);
+            }
+            if (PREV_FREE(arena, NEXT_FREE(arena, bp)) != bp) {
+                CHECK_FAIL("arena %d: free list %d has broken links at %p", arena->heap, i, bp);
+            }
+            if (GET_ALLOC(bp) || calc_free_list_index(GET_SIZE(bp)) != i) {
+                CHECK_FAIL("arena %d: block %p does not belong in free list %d", arena->heap, bp, i);
+            }
+            if (arena->placement == DY_PLACE_ADDRESS_FIT && PREV_FREE(arena, bp) != head && PREV_FREE(arena, bp) > bp) {
+                CHECK_FAIL("arena %d: free list %d is not in address order at %p", arena->heap, i, bp);
+            }
+            roverListed |= bp == arena->rovers[i];
+        }
+        if (!roverListed) {
+            CHECK_FAIL("arena %d: rover %p of free list %d is not in the list", arena->heap, arena->rovers[i], i);
+        }
+        if (count != arena->free_list_blocks[i]) {
+            CHECK_FAIL("arena %d: free list %d has %zu blocks but counts %zu", arena->heap, i, count, arena->free_list_blocks[i]);
+        }
+        if ((count > 0) != (find_free_list(arena, i) == i)) {
+            CHECK_FAIL("arena %d: free list %d is %s but marked otherwise", arena->heap, i, count > 0 ? "non-empty" : "empty");
+        }
+        listedBlocks += count;
+    }
+
+    // Every fragment must be a free block too small for the free lists, in this heap
+    size_t listedFragments = 0;
+    uint32_t prevRow = 0;
+    for (uint32_t row = arena->fragments; row != 0; row = FRAGMENT_LINKS((dy_block *)(start + (size_t)row * ROW_SIZE))->next) {
+        dy_block *bp = start + (size_t)row * ROW_SIZE;
+        if ((void *)bp >= (void *)epilogue || ++listedFragments > maxBlocks) {
+            CHECK_FAIL("arena %d: fragment list links to %p outside of the heap or loops", arena->heap, bp);
+        }
+        if (FRAGMENT_LINKS(bp)->prev != prevRow) {
+            CHECK_FAIL("arena %d: fragment list has broken links at %p", arena->heap, bp);
+        }
+        if (GET_ALLOC(bp) || !IS_FRAGMENT(GET_SIZE(bp))) {
+            CHECK_FAIL("arena %d: block %p does not belong in the fragment list", arena->heap, bp);
+        }
+        prevRow = row;
+    }
+    if (listedFragments != fragments || listedFragments != arena->fragment_blocks) {
+        CHECK_FAIL("arena %d: heap has %zu fragments but the fragment list holds %zu and counts %zu",
+                   arena->heap, fragments, listedFragments, arena->fragment_blocks);
+    }
+
+    if (listedBlocks != freeBlocks || arena->free_bytes != freeBytes) {
+        CHECK_FAIL("arena %d: heap has %zu free blocks (%zu bytes) but free lists hold %zu (%zu bytes)",
+                   arena->heap, freeBlocks, freeBytes, listedBlocks, arena->free_bytes);
+    }
+
+    // The tree holds exactly the free blocks above the threshold
+    long nodes = count_tree_nodes(arena->tree_root, NULL);
+    if (nodes < 0 || (size_t)nodes != treeBlocks) {
+        CHECK_FAIL("arena %d: best fit tree is broken or holds %ld blocks instead of %zu", arena->heap, nodes, treeBlocks);
+    }
+    return 0;
+}
+
+// Check the quick lists of the calling thread
+static int check_quick_lists() {
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        int count = 0;
+        for (dy_block *bp = dy_quick_lists[i].first; bp != NULL; bp = QUICK_NEXT(bp)) {
+            if (++count > dy_quick_lists[i].length) {
+                CHECK_FAIL("quick list %d holds more than its length of %d", i, dy_quick_lists[i].length);
+            }
+            int heap = dy_mem_heap_index(bp);
+            if (heap < 0 || heap >= DY_NUM_ARENAS) {
+                CHECK_FAIL("quick list %d links to %p outside of the heaps", i, bp);
+            }
+            if (!GET_ALLOC(bp) || !GET_IN_QUICK_LIST(bp) || GET_SIZE(bp) != QUICK_LIST_BLOCK_SIZE(i)) {
+                CHECK_FAIL("block %p does not belong in quick list %d", bp, i);
+            }
+        }
+        if (count != dy_quick_lists[i].length) {
+            CHECK_FAIL("quick list %d holds %d blocks but has length %d", i, count, dy_quick_lists[i].length);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checks the consistency of every arena heap and of the calling thread's quick lists.
+ * A description of the first problem found is printed to stderr.
+ *
+ * @return If the heaps are consistent, 0 is returned.
+ *         Otherwise, -1 is returned and dy_errno is set to EFAULT.
+ */
+int dy_heap_check() {
+    for (int i = 0; i < DY_NUM_ARENAS; i++) {
+        dy_arena *arena = &dy_arenas[i];
+        lock_arena(arena);
+        int result = arena->initialized ? check_arena(arena) : 0;
+        unlock_arena(arena);
+        if (result) {
+            dy_errno = EFAULT;
+            return -1;
+        }
+    }
+    if (check_quick_lists()) {
+        dy_errno = EFAULT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Calls a function for every block of every arena heap, in address order.
+ * Each arena is locked while it is walked, so the callback must not allocate or free memory.
+ * Slab objects and large blocks are not part of the arena heaps and are not visited.
+ *
+ * @param callback Called with the payload pointer, block size and state (DY_WALK_*) of each block,
+ *                 and arg. A non-zero return value stops the walk.
+ * @param arg Passed through to the callback.
+ *
+ * @return 0 if every block was visited, otherwise the value returned by the callback that stopped the walk.
+ */
+int dy_heap_walk(int (*callback)(void *ptr, size_t size, int state, void *arg), void *arg) {
+    for (int i = 0; i < DY_NUM_ARENAS; i++) {
+        dy_arena *arena = &dy_arenas[i];
+        lock_arena(arena);
+        if (!arena->initialized) {
+            unlock_arena(arena);
+            continue;
+        }
+        dy_block *epilogue = EPILOGUE(dy_mem_heap_end(arena->heap));
+        dy_block *block = FIRST_BLOCK(arena->base);
+        int result = 0;
+        while (block < epilogue && result == 0) {
+            int state = !GET_ALLOC(block) ? DY_WALK_FREE : GET_IN_QUICK_LIST(block) ? DY_WALK_QUICK : DY_WALK_ALLOCATED;
+            result = callback(block->body.payload, GET_SIZE(block), state, arg);
+            block = (void *)block + GET_SIZE(block);
+        }
+        unlock_arena(arena);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
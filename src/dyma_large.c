@@ -0,0 +1,235 @@
+#include "dyma_utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dyma.h"
+
+/*
+ * Large blocks bypass the arenas entirely: each one gets its own mapping from the memory
+ * backend, which is returned to the backend as soon as the block is freed. Every large block
+ * has a regular header (so the usual size macros work on it), preceded by a prefix recording
+ * where its mapping starts and a tag used to recognize it. The live large blocks are also kept in
+ * a sorted array, so that pointers outside of the heaps are only dereferenced once they are known
+ * to be large blocks.
+ */
+
+// Offset of the payload from the start of the mapping, unless a larger alignment was requested
+#define LARGE_PAYLOAD_OFFSET (sizeof(dy_large_prefix) + ROW_SIZE)
+
+// Bytes mapped for large blocks, and the most there have been at once
+static size_t large_bytes = 0;
+static size_t peak_large_bytes = 0;
+
+// Add to the bytes mapped for large blocks, updating the peak
+static void add_large_bytes(size_t size) {
+    size_t bytes = __atomic_add_fetch(&large_bytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_large_bytes, __ATOMIC_RELAXED);
+    while (bytes > peak && !__atomic_compare_exchange_n(&peak_large_bytes, &peak, bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Addresses of the live large blocks, in increasing order
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static dy_block **live_blocks = NULL;
+static size_t live_count = 0;
+static size_t live_capacity = 0;
+
+// Index of the first live large block at or after an address (live lock must be held)
+static size_t find_live_block(dy_block *block) {
+    size_t lo = 0, hi = live_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (live_blocks[mid] < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Record a new large block as live (live lock must be held)
+static int add_live_block(dy_block *block) {
+    if (live_count == live_capacity) {
+        size_t size = live_capacity * sizeof(dy_block *);
+        size_t newSize = size == 0 ? PAGE_SZ : size * 2;
+        void *array = size == 0 ? dy_mem_map(newSize) : dy_mem_remap(live_blocks, size, newSize);
+        if (array == NULL) {
+            return -1;
+        }
+        live_blocks = array;
+        live_capacity = newSize / sizeof(dy_block *);
+    }
+    size_t i = find_live_block(block);
+    memmove(&live_blocks[i + 1], &live_blocks[i], (live_count - i) * sizeof(dy_block *));
+    live_blocks[i] = block;
+    __atomic_store_n(&live_count, live_count + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Forget a large block that is no longer live (live lock must be held)
+static void remove_live_block(dy_block *block) {
+    size_t i = find_live_block(block);
+    if (i < live_count && live_blocks[i] == block) {
+        __atomic_store_n(&live_count, live_count - 1, __ATOMIC_RELAXED);
+        memmove(&live_blocks[i], &live_blocks[i + 1], (live_count - i) * sizeof(dy_block *));
+    }
+}
+
+// Round a size up to a whole number of pages
+static size_t round_to_pages(size_t size) {
+    return (size + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+}
+
+// Initialize the prefix and header of a large block whose payload starts at pp
+static dy_block *init_large_block(void *map, size_t mapSize, void *pp) {
+    dy_block *block = pp - HEADER_SIZE;
+    dy_large_prefix *prefix = LARGE_PREFIX(block);
+    prefix->map = map;
+    prefix->map_size = mapSize;
+    prefix->tag = LARGE_BLOCK_TAG ^ (uintptr_t)block;
+    // The block extends to the end of the mapping (or its last whole row, with compact headers)
+    CLEAR_HEADER(block);
+    SET_SIZE(block, (size_t)(map + mapSize - (void *)block) & ~(size_t)(ROW_SIZE - 1));
+    SET_ALLOC(block);
+    return block;
+}
+
+/**
+ * Get a large block in its own mapping.
+ * @param size The payload size requested.
+ * @param align The alignment of the payload (a power of two, at least ROW_SIZE).
+ * @return A pointer to the block, or NULL if no memory could be mapped.
+ */
+dy_block *get_large_block(size_t size, size_t align) {
+    // Leave room to move the payload forward to the requested alignment, the whole mapping must fit in a header
+    size_t padding = align > LARGE_PAYLOAD_OFFSET ? align : 0;
+    if (size > MAX_BLOCK_SIZE - LARGE_PAYLOAD_OFFSET - padding - PAGE_SZ) {
+        dy_errno = ENOMEM;
+        return NULL;
+    }
+    size_t mapSize = round_to_pages(LARGE_PAYLOAD_OFFSET + padding + size);
+    void *map = dy_mem_map(mapSize);
+    if (map == NULL) {
+        dy_errno = ENOMEM;
+        return NULL;
+    }
+    add_large_bytes(mapSize);
+
+    // Find the first suitably aligned payload address after the prefix and header
+    uintptr_t pp = (uintptr_t)map + LARGE_PAYLOAD_OFFSET;
+    pp = (pp + align - 1) & ~(uintptr_t)(align - 1);
+    dy_block *block = init_large_block(map, mapSize, (void *)pp);
+
+    pthread_mutex_lock(&live_lock);
+    int result = add_live_block(block);
+    pthread_mutex_unlock(&live_lock);
+    if (result == -1) {
+        free_large_block(block);
+        dy_errno = ENOMEM;
+        return NULL;
+    }
+    return block;
+}
+
+/**
+ * Resize a large block, moving its mapping if needed.
+ * @param block The large block to resize.
+ * @param size The new payload size requested.
+ * @return A pointer to the resized block, or NULL if it could not be resized (the block is left unchanged).
+ */
+dy_block *resize_large_block(dy_block *block, size_t size) {
+    dy_large_prefix *prefix = LARGE_PREFIX(block);
+    void *map = prefix->map;
+    size_t offset = (void *)block->body.payload - map;
+
+    // Only blocks at the default offset can move, as moving could break a larger alignment
+    if (offset != LARGE_PAYLOAD_OFFSET || size > MAX_BLOCK_SIZE - offset - PAGE_SZ) {
+        return NULL;
+    }
+    size_t mapSize = round_to_pages(offset + size);
+    if (mapSize == prefix->map_size) {
+        return block;
+    }
+    size_t oldSize = prefix->map_size;
+    void *newMap = dy_mem_remap(map, oldSize, mapSize);
+    if (newMap == NULL) {
+        return NULL;
+    }
+    add_large_bytes(mapSize - oldSize);
+    dy_block *newBlock = init_large_block(newMap, mapSize, newMap + offset);
+
+    // Removing the old block first leaves room for the new one
+    pthread_mutex_lock(&live_lock);
+    remove_live_block(block);
+    add_live_block(newBlock);
+    pthread_mutex_unlock(&live_lock);
+    return newBlock;
+}
+
+/**
+ * Free a large block, returning its mapping to the memory backend.
+ * @param block The large block to free.
+ */
+void free_large_block(dy_block *block) {
+    pthread_mutex_lock(&live_lock);
+    remove_live_block(block);
+    pthread_mutex_unlock(&live_lock);
+
+    dy_large_prefix *prefix = LARGE_PREFIX(block);
+    // Clear the tag so that the block is no longer recognized if freed again
+    prefix->tag = 0;
+    __atomic_sub_fetch(&large_bytes, prefix->map_size, __ATOMIC_RELAXED);
+    dy_mem_unmap(prefix->map, prefix->map_size);
+}
+
+/**
+ * Check if a block outside of the heaps is a valid large block.
+ * @param block The block to check.
+ * @return 0 if the block is a valid large block, -1 otherwise.
+ */
+int check_large_block(dy_block *block) {
+    // Anything else could be unmapped, don't touch it
+    if (__atomic_load_n(&live_count, __ATOMIC_RELAXED) == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&live_lock);
+    size_t i = find_live_block(block);
+    bool live = i < live_count && live_blocks[i] == block;
+    pthread_mutex_unlock(&live_lock);
+    if (!live) {
+        return -1;
+    }
+
+    dy_large_prefix *prefix = LARGE_PREFIX(block);
+    if (prefix->tag != (LARGE_BLOCK_TAG ^ (uintptr_t)block)) {
+        return -1;
+    }
+    // Check that the block fills the rest of its mapping
+    size_t size = (size_t)(prefix->map + prefix->map_size - (void *)block) & ~(size_t)(ROW_SIZE - 1);
+    if ((void *)block < prefix->map || GET_SIZE(block) != size) {
+        return -1;
+    }
+    if (!GET_ALLOC(block)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return The number of bytes mapped for large blocks.
+ */
+size_t get_large_bytes() {
+    return __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return The most bytes mapped for large blocks at once.
+ */
+size_t get_peak_large_bytes() {
+    return __atomic_load_n(&peak_large_bytes, __ATOMIC_RELAXED);
+}
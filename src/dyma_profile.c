@@ -0,0 +1,274 @@
+#include "dyma_utils.h"
+
+#include <execinfo.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dyma.h"
+
+/*
+ * The sampling profiler records one allocation every DY_OPT_PROFILE_RATE bytes on average. Each
+ * thread counts down the bytes until its next sample, with the gaps between samples drawn from
+ * an exponential distribution so that allocation patterns can't line up with the sampling. A
+ * sampled allocation gets a backtrace, charged to a record per call stack, and is remembered
+ * until it is freed. Each bucket of the table of live samples keeps a count of its samples that frees
+ * read without locking, so only frees of allocations that share a bucket with a sample take the lock.
+ *
+ * The profiler's own records come from mappings of the memory backend, never from the heaps.
+ */
+
+#define PROFILE_DEPTH 32        // Deepest call stack recorded
+#define PROFILE_SKIP 2          // Frames of the allocator itself at the top of each backtrace
+#define SAMPLE_BUCKETS (1 << PROFILE_BUCKET_BITS) // Buckets of the table of live samples, by address
+#define STACK_BUCKETS 1024      // Buckets of the table of call stacks, by hash
+#define POOL_CHUNK (PAGE_SZ * 16)
+
+// Bytes allocated between checks for the profiler being enabled, while it is disabled
+#define PROFILE_RECHECK (1 << 20)
+
+typedef struct dy_profile_stack {
+    uint64_t hash;
+    int depth;
+    void *pcs[PROFILE_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t alloc_count;
+    size_t alloc_bytes;
+    struct dy_profile_stack *next;
+} dy_profile_stack;
+
+typedef struct dy_profile_sample {
+    void *ptr;
+    size_t size;
+    dy_profile_stack *stack;
+    struct dy_profile_sample *next;
+} dy_profile_sample;
+
+__thread long dy_bytes_until_sample = 0;
+uint32_t dy_profile_marks[SAMPLE_BUCKETS];
+
+static __thread bool sampling = false;
+static __thread uint64_t sample_seed = 0;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static dy_profile_sample *samples[SAMPLE_BUCKETS];
+static dy_profile_stack *stacks[STACK_BUCKETS];
+static dy_profile_sample *free_samples = NULL;
+static void *pool = NULL;
+static size_t pool_left = 0;
+
+// Add a sample to its bucket of the sample table (profile lock must be held)
+static void insert_sample(dy_profile_sample *sample) {
+    size_t bucket = PROFILE_BUCKET(sample->ptr);
+    sample->next = samples[bucket];
+    samples[bucket] = sample;
+    __atomic_add_fetch(&dy_profile_marks[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Remove a sample from the sample table, given the link to it (profile lock must be held)
+static void remove_sample(dy_profile_sample **link) {
+    dy_profile_sample *sample = *link;
+    *link = sample->next;
+    __atomic_sub_fetch(&dy_profile_marks[PROFILE_BUCKET(sample->ptr)], 1, __ATOMIC_RELAXED);
+}
+
+// Carve a record out of the profiler's pool (profile lock must be held)
+static void *pool_alloc(size_t size) {
+    if (pool_left < size) {
+        pool = dy_mem_map(POOL_CHUNK);
+        if (pool == NULL) {
+            pool_left = 0;
+            return NULL;
+        }
+        pool_left = POOL_CHUNK;
+    }
+    void *record = pool;
+    pool += size;
+    pool_left -= size;
+    return record;
+}
+
+// Draw the number of bytes until the next sample of the calling thread
+static long next_sample_gap(size_t rate) {
+    if (sample_seed == 0) {
+        sample_seed = (uintptr_t)&sample_seed | 1;
+    }
+    // xorshift64*, using the top 53 bits as a uniform value in (0, 1]
+    sample_seed ^= sample_seed >> 12;
+    sample_seed ^= sample_seed << 25;
+    sample_seed ^= sample_seed >> 27;
+    double u = ((sample_seed * 0x2545f4914f6cdd1dULL >> 11) + 1) / 9007199254740992.0;
+    double gap = -log(u) * rate;
+    return gap > (double)(1L << 40) ? 1L << 40 : (long)gap;
+}
+
+// Find the record of a call stack, creating it if needed (profile lock must be held)
+static dy_profile_stack *find_stack(void **pcs, int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+    }
+    dy_profile_stack **bucket = &stacks[hash % STACK_BUCKETS];
+    for (dy_profile_stack *stack = *bucket; stack != NULL; stack = stack->next) {
+        if (stack->hash == hash && stack->depth == depth && !memcmp(stack->pcs, pcs, depth * sizeof(void *))) {
+            return stack;
+        }
+    }
+    dy_profile_stack *stack = pool_alloc(sizeof(dy_profile_stack));
+    if (stack == NULL) {
+        return NULL;
+    }
+    memset(stack, 0, sizeof(dy_profile_stack));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->pcs, pcs, depth * sizeof(void *));
+    stack->next = *bucket;
+    *bucket = stack;
+    return stack;
+}
+
+/**
+ * Called when the calling thread's countdown to its next sample runs out.
+ * Records the allocation if the profiler was already running, and starts the next countdown.
+ * @param pp The allocation that used up the countdown.
+ * @param size Its requested size.
+ */
+void profile_sample(void *pp, size_t size) {
+    size_t rate = dy_config.profile_rate;
+    if (rate == 0) {
+        // Disabled, check again later
+        sampling = false;
+        dy_bytes_until_sample = PROFILE_RECHECK;
+        return;
+    }
+    dy_bytes_until_sample = next_sample_gap(rate);
+    if (!sampling) {
+        // Just enabled, start counting down from here
+        sampling = true;
+        return;
+    }
+
+    void *pcs[PROFILE_DEPTH + PROFILE_SKIP];
+    int depth = backtrace(pcs, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+    if (depth < 0) {
+        depth = 0;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+    dy_profile_stack *stack = find_stack(pcs + PROFILE_SKIP, depth);
+    dy_profile_sample *sample = free_samples;
+    if (sample != NULL) {
+        free_samples = sample->next;
+    } else {
+        sample = pool_alloc(sizeof(dy_profile_sample));
+    }
+    if (stack != NULL && sample != NULL) {
+        sample->ptr = pp;
+        sample->size = size;
+        sample->stack = stack;
+        insert_sample(sample);
+        stack->live_count++;
+        stack->live_bytes += size;
+        stack->alloc_count++;
+        stack->alloc_bytes += size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Find the link to the sample of an allocation (profile lock must be held)
+static dy_profile_sample **find_sample(void *pp) {
+    dy_profile_sample **link = &samples[PROFILE_BUCKET(pp)];
+    while (*link != NULL && (*link)->ptr != pp) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * Forget the sample of an allocation that is being freed, if it was sampled.
+ * @param pp The allocation.
+ */
+void profile_free(void *pp) {
+    pthread_mutex_lock(&profile_lock);
+    dy_profile_sample **link = find_sample(pp);
+    dy_profile_sample *sample = *link;
+    if (sample != NULL) {
+        remove_sample(link);
+        sample->stack->live_count--;
+        sample->stack->live_bytes -= sample->size;
+        sample->next = free_samples;
+        free_samples = sample;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * Update the sample of an allocation that moved or changed size without being freed, if it was sampled.
+ * @param pp The allocation.
+ * @param new_pp Its new address.
+ * @param size Its new requested size.
+ */
+void profile_update(void *pp, void *new_pp, size_t size) {
+    pthread_mutex_lock(&profile_lock);
+    dy_profile_sample **link = find_sample(pp);
+    dy_profile_sample *sample = *link;
+    if (sample != NULL) {
+        sample->stack->live_bytes += size - sample->size;
+        sample->size = size;
+        if (new_pp != pp) {
+            remove_sample(link);
+            sample->ptr = new_pp;
+            insert_sample(sample);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * Writes the sampled allocations in the legacy heap profile format read by pprof.
+ * Each call stack gets a line with the live sampled objects and bytes, followed by every sampled
+ * allocation made there since the start (in brackets). The totals come first, and the mappings of
+ * the process last, so that pprof can symbolize the addresses.
+ *
+ * @param out The stream to write to.
+ * @return 0 if successful, -1 if the profile could not be written.
+ */
+int dy_profile_dump(FILE *out) {
+    pthread_mutex_lock(&profile_lock);
+    size_t liveCount = 0, liveBytes = 0, allocCount = 0, allocBytes = 0;
+    for (int i = 0; i < STACK_BUCKETS; i++) {
+        for (dy_profile_stack *stack = stacks[i]; stack != NULL; stack = stack->next) {
+            liveCount += stack->live_count;
+            liveBytes += stack->live_bytes;
+            allocCount += stack->alloc_count;
+            allocBytes += stack->alloc_bytes;
+        }
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", liveCount, liveBytes, allocCount, allocBytes,
+            dy_config.profile_rate);
+    for (int i = 0; i < STACK_BUCKETS; i++) {
+        for (dy_profile_stack *stack = stacks[i]; stack != NULL; stack = stack->next) {
+            fprintf(out, "%zu: %zu [%zu: %zu] @", stack->live_count, stack->live_bytes, stack->alloc_count, stack->alloc_bytes);
+            for (int j = 0; j < stack->depth; j++) {
+                fprintf(out, " %p", stack->pcs[j]);
+            }
+            fputc('\n', out);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    // Mappings of the process, for symbolization
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), maps) != NULL) {
+            fputs(line, out);
+        }
+        fclose(maps);
+    }
+    return ferror(out) ? -1 : 0;
+}
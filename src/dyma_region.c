@@ -0,0 +1,163 @@
+#include "dyma_utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dyma.h"
+
+/*
+ * Regions hand out memory by bumping a pointer through large chunks obtained with dy_malloc.
+ * Objects in a region are never freed on their own; instead the whole region is reset or
+ * destroyed at once, which frees its chunks in a single batch.
+ */
+
+// Default size of the chunks of a region
+#define REGION_CHUNK_SIZE ((size_t)1 << 16)
+
+typedef struct dy_region_chunk {
+    struct dy_region_chunk *next;
+    size_t size; // Usable bytes after this header
+} dy_region_chunk;
+
+struct dy_region {
+    dy_region_chunk *chunks; // Most recent chunk first, the first chunk ever allocated last
+    dy_region_chunk *first;  // The first chunk ever allocated, kept on reset
+    dy_region_chunk *large;  // Chunks of objects too large to share a chunk, always freed on reset
+    char *cur;
+    char *end;
+    size_t chunk_size;
+};
+
+#define CHUNK_START(chunk) ((char *)(chunk) + sizeof(dy_region_chunk))
+
+// Allocate a chunk with room for size bytes
+static dy_region_chunk *new_chunk(size_t size) {
+    if (size > SIZE_MAX - sizeof(dy_region_chunk)) {
+        dy_errno = ENOMEM;
+        return NULL;
+    }
+    dy_region_chunk *chunk = dy_malloc(sizeof(dy_region_chunk) + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->size = size;
+    return chunk;
+}
+
+// Free the chunks of a list from the given one up to, but not including, stop
+static void free_chunks(dy_region_chunk *chunk, dy_region_chunk *stop) {
+    // Chunks allocated one after another are often adjacent, so free them in batches
+    void *batch[64];
+    size_t n = 0;
+    while (chunk != stop) {
+        dy_region_chunk *next = chunk->next;
+        batch[n++] = chunk;
+        if (n == sizeof(batch) / sizeof(batch[0])) {
+            dy_free_batch(batch, n);
+            n = 0;
+        }
+        chunk = next;
+    }
+    dy_free_batch(batch, n);
+}
+
+/**
+ * Creates an empty region.
+ * @param chunk_size Size of the chunks memory is carved from, or 0 for the default (64KB).
+ * @return If successful, a pointer to the region.
+ *         If allocation fails, then NULL is returned and dy_errno is set to ENOMEM.
+ */
+dy_region *dy_region_create(size_t chunk_size) {
+    dy_region *region = dy_malloc(sizeof(dy_region));
+    if (region == NULL) {
+        return NULL;
+    }
+    region->chunks = NULL;
+    region->first = NULL;
+    region->large = NULL;
+    region->cur = NULL;
+    region->end = NULL;
+    region->chunk_size = chunk_size == 0 ? REGION_CHUNK_SIZE : chunk_size;
+    return region;
+}
+
+/**
+ * Allocates memory from a region. The memory stays valid until the region is reset or destroyed.
+ * @param region The region to allocate from.
+ * @param size Size of memory to allocate in bytes.
+ * @return If successful, a pointer to an uninitialized region of memory of the specified size, aligned like dy_malloc.
+ *         If size is 0, then NULL is returned.
+ *         If allocation fails, then NULL is returned and dy_errno is set to ENOMEM.
+ */
+void *dy_region_alloc(dy_region *region, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > SIZE_MAX - ROW_SIZE) {
+        dy_errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + ROW_SIZE - 1) & ~(size_t)(ROW_SIZE - 1);
+
+    // Bump allocate from the current chunk
+    if (size <= (size_t)(region->end - region->cur)) {
+        void *ptr = region->cur;
+        region->cur += size;
+        return ptr;
+    }
+
+    // Large objects get a chunk of their own, kept apart so the current chunk stays in use
+    if (size > region->chunk_size / 4) {
+        dy_region_chunk *chunk = new_chunk(size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = region->large;
+        region->large = chunk;
+        return CHUNK_START(chunk);
+    }
+
+    // Start a new chunk, every chunk in the list has the region's chunk size
+    dy_region_chunk *chunk = new_chunk(region->chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    if (region->first == NULL) {
+        region->first = chunk;
+    }
+    region->cur = CHUNK_START(chunk) + size;
+    region->end = CHUNK_START(chunk) + chunk->size;
+    return CHUNK_START(chunk);
+}
+
+/**
+ * Releases everything allocated from a region at once, keeping its first chunk for reuse.
+ * @param region The region to reset.
+ */
+void dy_region_reset(dy_region *region) {
+    free_chunks(region->large, NULL);
+    region->large = NULL;
+    dy_region_chunk *first = region->first;
+    if (first == NULL) {
+        return;
+    }
+
+    // The first chunk is at the end of the list, so everything before it goes
+    free_chunks(region->chunks, first);
+    region->chunks = first;
+    region->cur = CHUNK_START(first);
+    region->end = CHUNK_START(first) + first->size;
+}
+
+/**
+ * Releases everything allocated from a region, and the region itself.
+ * @param region The region to destroy.
+ */
+void dy_region_destroy(dy_region *region) {
+    free_chunks(region->large, NULL);
+    free_chunks(region->chunks, NULL);
+    dy_free(region);
+}
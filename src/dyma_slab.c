@@ -0,0 +1,201 @@
+#include "dyma_utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dyma.h"
+
+/*
+ * Small requests (up to DY_OPT_SLAB_MAX bytes) can be served from slab pages instead of the
+ * arenas. Each slab page lives in its own heap and holds objects of a single size class, with no
+ * header per object: the page header is found by masking an object's address, and a bitmap in
+ * it records which objects are free. Pages with free objects are kept in a list per size class,
+ * and pages that become entirely free are recycled for any size class.
+ */
+
+typedef struct dy_slab_class {
+    pthread_mutex_t lock;
+    dy_slab_page *partial; // Pages with at least one free object
+} dy_slab_class;
+
+static dy_slab_class slab_classes[SLAB_NUM_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+// Entirely free pages, ready to be used by any size class
+static pthread_mutex_t free_pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static dy_slab_page *free_pages = NULL;
+
+// Initialize the locks of the size classes
+static void init_slab_classes() {
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_init(&slab_classes[i].lock, NULL);
+    }
+}
+
+// Calculate the index of the size class for a request size
+static int calc_slab_class(size_t size) {
+    return (size + ROW_SIZE - 1) / ROW_SIZE - 1;
+}
+
+// Push a page onto the partial list of its size class
+static void push_partial(dy_slab_class *class, dy_slab_page *page) {
+    page->prev = NULL;
+    page->next = class->partial;
+    if (class->partial != NULL) {
+        class->partial->prev = page;
+    }
+    class->partial = page;
+}
+
+// Remove a page from the partial list of its size class
+static void remove_partial(dy_slab_class *class, dy_slab_page *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        class->partial = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+}
+
+// Get a page for a size class, reusing a free page if there is one
+static dy_slab_page *new_slab_page(size_t objectSize) {
+    pthread_mutex_lock(&free_pages_lock);
+    dy_slab_page *page = free_pages;
+    if (page != NULL) {
+        free_pages = page->next;
+    } else {
+        page = dy_mem_heap_grow(DY_SLAB_HEAP, 1);
+    }
+    pthread_mutex_unlock(&free_pages_lock);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    // Mark every object as free
+    page->object_size = objectSize;
+    page->count = (PAGE_SZ - SLAB_OBJECTS_OFFSET) / objectSize;
+    page->free_count = page->count;
+    for (size_t i = 0; i < SLAB_MAP_WORDS; i++) {
+        size_t first = i * 64;
+        if (first + 64 <= page->count) {
+            page->free_map[i] = ~(uint64_t)0;
+        } else if (first < page->count) {
+            page->free_map[i] = ((uint64_t)1 << (page->count - first)) - 1;
+        } else {
+            page->free_map[i] = 0;
+        }
+    }
+    page->next = NULL;
+    page->prev = NULL;
+    page->tag = SLAB_PAGE_TAG ^ (uintptr_t)page;
+    return page;
+}
+
+/**
+ * Get an object from a slab page.
+ * @param size The size requested, at most SLAB_MAX_SIZE bytes.
+ * @return A pointer to the object, or NULL if no page could be allocated (dy_errno is set to ENOMEM).
+ */
+void *get_slab_object(size_t size) {
+    pthread_once(&slab_once, init_slab_classes);
+    dy_slab_class *class = &slab_classes[calc_slab_class(size)];
+    pthread_mutex_lock(&class->lock);
+
+    // Take the first page with a free object, or start a new one
+    dy_slab_page *page = class->partial;
+    if (page == NULL) {
+        page = new_slab_page((calc_slab_class(size) + 1) * ROW_SIZE);
+        if (page == NULL) {
+            pthread_mutex_unlock(&class->lock);
+            dy_errno = ENOMEM;
+            return NULL;
+        }
+        push_partial(class, page);
+    }
+
+    // Find the first free object using the bitmap
+    size_t word = 0;
+    while (page->free_map[word] == 0) {
+        word++;
+    }
+    size_t index = word * 64 + __builtin_ctzll(page->free_map[word]);
+    page->free_map[word] &= page->free_map[word] - 1;
+
+    // Full pages leave the partial list
+    if (--page->free_count == 0) {
+        remove_partial(class, page);
+    }
+    pthread_mutex_unlock(&class->lock);
+    return (void *)page + SLAB_OBJECTS_OFFSET + index * page->object_size;
+}
+
+/**
+ * Free an object to its slab page.
+ * @param pp The object to free, which must have passed check_slab_pointer.
+ */
+void free_slab_object(void *pp) {
+    dy_slab_page *page = SLAB_PAGE(pp);
+    dy_slab_class *class = &slab_classes[calc_slab_class(page->object_size)];
+    size_t index = (pp - (void *)page - SLAB_OBJECTS_OFFSET) / page->object_size;
+    pthread_mutex_lock(&class->lock);
+
+    page->free_map[index / 64] |= (uint64_t)1 << (index % 64);
+    page->free_count++;
+    if (page->free_count == 1) {
+        // The page was full, it has a free object again
+        push_partial(class, page);
+    } else if (page->free_count == page->count && (page->prev != NULL || page->next != NULL)) {
+        // Recycle empty pages, unless it is the only page left for this size class
+        remove_partial(class, page);
+        page->tag = 0;
+        pthread_mutex_lock(&free_pages_lock);
+        page->next = free_pages;
+        free_pages = page;
+        pthread_mutex_unlock(&free_pages_lock);
+    }
+    pthread_mutex_unlock(&class->lock);
+}
+
+/**
+ * Get the usable size of a slab object.
+ * @param pp The object, which must have passed check_slab_pointer.
+ * @return The size of the object's size class.
+ */
+size_t get_slab_object_size(void *pp) {
+    return SLAB_PAGE(pp)->object_size;
+}
+
+/**
+ * Check if a pointer in the slab heap is a valid, allocated slab object.
+ * @param pp The pointer to check.
+ * @return 0 if the pointer is valid, -1 otherwise.
+ */
+int check_slab_pointer(void *pp) {
+    dy_slab_page *page = SLAB_PAGE(pp);
+    if ((void *)page >= dy_mem_heap_end(DY_SLAB_HEAP) || page->tag != (SLAB_PAGE_TAG ^ (uintptr_t)page)) {
+        return -1;
+    }
+
+    // Check that the pointer is the start of an object
+    size_t offset = pp - (void *)page;
+    if (offset < SLAB_OBJECTS_OFFSET || (offset - SLAB_OBJECTS_OFFSET) % page->object_size != 0) {
+        return -1;
+    }
+    size_t index = (offset - SLAB_OBJECTS_OFFSET) / page->object_size;
+    if (index >= page->count) {
+        return -1;
+    }
+
+    // Check that the object is allocated
+    uint64_t word = __atomic_load_n(&page->free_map[index / 64], __ATOMIC_RELAXED);
+    if (word & ((uint64_t)1 << (index % 64))) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "dyma_utils.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dyma.h"
+
+/*
+ * Statistics are kept where they are cheapest to maintain. Operation counters are private to
+ * each thread and only read by dy_stats, which walks the list of live threads (counters of
+ * exited threads are folded into the totals). Free list counts and bytes are kept per arena
+ * under its lock, and each arena updates its peak usage whenever it is unlocked.
+ */
+
+__thread dy_thread_stats dy_thread_counters;
+
+// Live threads, and the counters of threads that have exited
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static dy_thread_stats *threads = NULL;
+static dy_thread_stats exited;
+
+/**
+ * Add the calling thread to the threads whose counters are aggregated by dy_stats.
+ */
+void register_thread_stats() {
+    dy_thread_counters.quick_lists = dy_quick_lists;
+    pthread_mutex_lock(&threads_lock);
+    dy_thread_counters.prev = NULL;
+    dy_thread_counters.next = threads;
+    if (threads != NULL) {
+        threads->prev = &dy_thread_counters;
+    }
+    threads = &dy_thread_counters;
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Remove the calling thread from the threads aggregated by dy_stats, keeping its counters in the totals.
+ */
+void unregister_thread_stats() {
+    pthread_mutex_lock(&threads_lock);
+    exited.mallocs += dy_thread_counters.mallocs;
+    exited.frees += dy_thread_counters.frees;
+    exited.reallocs += dy_thread_counters.reallocs;
+#ifdef DY_TRACE
+    add_trace_counters(&exited.trace, &dy_thread_counters.trace);
+    if (dy_thread_counters.trace_log != NULL) {
+        dy_mem_unmap(dy_thread_counters.trace_log, DY_TRACE_LOG_SIZE * sizeof(dy_trace_event));
+        dy_thread_counters.trace_log = NULL;
+    }
+#endif
+    if (dy_thread_counters.prev != NULL) {
+        dy_thread_counters.prev->next = dy_thread_counters.next;
+    } else {
+        threads = dy_thread_counters.next;
+    }
+    if (dy_thread_counters.next != NULL) {
+        dy_thread_counters.next->prev = dy_thread_counters.prev;
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Call a function for the counters of every live thread, and then for the totals of the threads that have exited.
+ * The list of threads is locked during the calls, but the counters may still be updated by their owners.
+ * @param callback The function to call with the counters.
+ * @param arg Argument passed through to the callback.
+ */
+void for_each_thread_stats(void (*callback)(dy_thread_stats *stats, void *arg), void *arg) {
+    pthread_mutex_lock(&threads_lock);
+    for (dy_thread_stats *thread = threads; thread != NULL; thread = thread->next) {
+        callback(thread, arg);
+    }
+    callback(&exited, arg);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+// Find the size of the largest free block of an arena (arena lock must be held)
+static size_t find_largest_free_block(dy_arena *arena) {
+    // The top chunk is outside of the free lists
+    size_t largest = arena->top != NULL ? GET_SIZE(arena->top) : 0;
+
+    // Blocks large enough for the tree are all in it, the largest is its rightmost node
+    if (arena->tree_root != NULL) {
+        dy_block *node = arena->tree_root;
+        while (TREE_NODE(node)->right != NULL) {
+            node = TREE_NODE(node)->right;
+        }
+        return GET_SIZE(node) > largest ? GET_SIZE(node) : largest;
+    }
+
+    // Otherwise look through the highest non-empty free list
+    for (int i = NUM_FREE_LISTS - 1; i >= 0; i--) {
+        if (arena->free_list_blocks[i] == 0) {
+            continue;
+        }
+        dy_block *head = &arena->free_list_heads[i];
+        for (dy_block *block = NEXT_FREE(arena, head); block != head; block = NEXT_FREE(arena, block)) {
+            if (GET_SIZE(block) > largest) {
+                largest = GET_SIZE(block);
+            }
+        }
+        break;
+    }
+    return largest;
+}
+
+// Add the operation counters and quick lists of a thread to the statistics
+static void add_thread_stats(dy_thread_stats *thread, void *arg) {
+    dy_heap_stats *stats = arg;
+    stats->mallocs += __atomic_load_n(&thread->mallocs, __ATOMIC_RELAXED);
+    stats->frees += __atomic_load_n(&thread->frees, __ATOMIC_RELAXED);
+    stats->reallocs += __atomic_load_n(&thread->reallocs, __ATOMIC_RELAXED);
+    // Threads that exited have given their quick lists back
+    if (thread->quick_lists == NULL) {
+        return;
+    }
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        int length = __atomic_load_n(&thread->quick_lists[i].length, __ATOMIC_RELAXED);
+        stats->quick_list_blocks[i] += length;
+        stats->quick_list_bytes[i] += length * QUICK_LIST_BLOCK_SIZE(i);
+    }
+}
+
+/**
+ * Collects statistics about the memory managed by the allocator.
+ * Each arena is locked in turn while its free lists are counted, so this is cheap enough to call
+ * periodically, but the result is not a single consistent snapshot when other threads are allocating.
+ *
+ * @param stats Structure receiving the statistics.
+ */
+void dy_stats(dy_heap_stats *stats) {
+    memset(stats, 0, sizeof(dy_heap_stats));
+
+    // Operation counters and quick lists of every thread (read while their owners may update them)
+    for_each_thread_stats(add_thread_stats, stats);
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        stats->quick_blocks += stats->quick_list_blocks[i];
+        stats->quick_bytes += stats->quick_list_bytes[i];
+    }
+
+    // Free lists of every arena
+    for (int i = 0; i < DY_NUM_ARENAS; i++) {
+        dy_arena *arena = &dy_arenas[i];
+        lock_arena(arena);
+        if (arena->initialized) {
+            for (int j = 0; j < NUM_FREE_LISTS; j++) {
+                stats->free_list_blocks[j] += arena->free_list_blocks[j];
+                stats->free_list_bytes[j] += arena->free_list_bytes[j];
+                stats->free_blocks += arena->free_list_blocks[j];
+            }
+            stats->free_blocks += arena->fragment_blocks + (arena->top != NULL);
+            stats->free_bytes += arena->free_bytes;
+            stats->used_bytes += arena->heap_bytes - arena->free_bytes;
+            stats->peak_used_bytes += arena->peak_used_bytes;
+            size_t largest = find_largest_free_block(arena);
+            if (largest > stats->largest_free_block) {
+                stats->largest_free_block = largest;
+            }
+        }
+        unlock_arena(arena);
+    }
+
+    // Heaps of the arenas and slab pages, and large blocks
+    for (int i = 0; i < DY_MEM_HEAPS; i++) {
+        if (dy_mem_heap_start(i) != NULL) {
+            stats->heap_bytes += dy_mem_heap_end(i) - dy_mem_heap_start(i);
+        }
+    }
+    stats->large_bytes = get_large_bytes();
+    stats->used_bytes += stats->large_bytes;
+    stats->peak_used_bytes += get_peak_large_bytes();
+    if (stats->free_bytes > 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free_block / stats->free_bytes;
+    }
+}
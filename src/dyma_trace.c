@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "dyma_utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dyma.h"
+
+/*
+ * Tracepoints on the allocation and free paths, compiled in with make TRACE=1 and removed
+ * entirely otherwise. Each thread counts which path served its allocations and frees, how many
+ * blocks its free list scans looked at and how many blocks its quick list flushes returned, in
+ * its dy_thread_stats next to the operation counters. With TRACE=log every event is also written
+ * with a timestamp to a ring of the thread's last DY_TRACE_LOG_SIZE events.
+ */
+
+#ifdef DY_TRACE
+
+static const char *trace_names[TRACE_NUM_TYPES] = {
+    "malloc slab", "malloc large", "malloc quick list", "malloc free list", "malloc heap",
+    "free slab", "free large", "free quick list", "free free list",
+    "tree search", "free list scan", "quick list flush", "coalesce sweep",
+};
+
+/**
+ * Add one set of trace counters to another.
+ * @param total The counters to add to.
+ * @param counters The counters to add, which may be updated concurrently by their thread.
+ */
+void add_trace_counters(dy_trace_counters *total, dy_trace_counters *counters) {
+    for (int i = 0; i < TRACE_NUM_TYPES; i++) {
+        total->events[i] += __atomic_load_n(&counters->events[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < TRACE_SCAN_BUCKETS; i++) {
+        total->scans[i] += __atomic_load_n(&counters->scans[i], __ATOMIC_RELAXED);
+    }
+    total->scanned += __atomic_load_n(&counters->scanned, __ATOMIC_RELAXED);
+    total->flushed += __atomic_load_n(&counters->flushed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write an event to the log of the calling thread, overwriting its oldest event once the log is full.
+ * @param type The type of the event.
+ * @param arg The size or count recorded with the event.
+ */
+void trace_log(size_t type, size_t arg) {
+    if (dy_thread_counters.trace_log == NULL) {
+        dy_thread_counters.trace_log = dy_mem_map(DY_TRACE_LOG_SIZE * sizeof(dy_trace_event));
+        if (dy_thread_counters.trace_log == NULL) {
+            return;
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dy_trace_event *event = &dy_thread_counters.trace_log[dy_thread_counters.trace_next % DY_TRACE_LOG_SIZE];
+    event->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    event->type = type;
+    event->arg = arg;
+    __atomic_store_n(&dy_thread_counters.trace_next, dy_thread_counters.trace_next + 1, __ATOMIC_RELEASE);
+}
+
+// Add the counters of a thread to the totals
+static void sum_thread_trace(dy_thread_stats *stats, void *arg) {
+    add_trace_counters(arg, &stats->trace);
+}
+
+#ifdef DY_TRACE_LOG
+// Print the events in the log of a thread, oldest first
+static void dump_thread_log(dy_thread_stats *stats, void *arg) {
+    FILE *out = arg;
+    size_t next = __atomic_load_n(&stats->trace_next, __ATOMIC_ACQUIRE);
+    if (stats->trace_log == NULL || next == 0) {
+        return;
+    }
+    size_t first = next > DY_TRACE_LOG_SIZE ? next - DY_TRACE_LOG_SIZE : 0;
+    fprintf(out, "\nlast %zu events of thread %p:\n", next - first, (void *)stats);
+    for (size_t i = first; i < next; i++) {
+        dy_trace_event *event = &stats->trace_log[i % DY_TRACE_LOG_SIZE];
+        fprintf(out, "%20llu  %-18s %zu\n", (unsigned long long)event->time, trace_names[event->type], event->arg);
+    }
+}
+#endif
+
+// Print a count as a share of a total
+static void print_share(FILE *out, const char *name, size_t count, size_t total) {
+    fprintf(out, "  %-18s %12zu %6.1f%%\n", name, count, total > 0 ? 100.0 * count / total : 0.0);
+}
+
+/**
+ * Write a summary of the tracepoints of every thread: which paths served allocations and frees,
+ * a histogram of free list scan lengths and how many blocks quick list flushes returned, followed
+ * by the log of each live thread in builds made with TRACE=log.
+ * Counters of running threads are read while they may still change.
+ *
+ * @param out The stream to write the summary to.
+ * @return 0 on success, or -1 if the allocator was built without tracepoints (dy_errno is set to ENOSYS).
+ */
+int dy_trace_dump(FILE *out) {
+    dy_trace_counters total;
+    memset(&total, 0, sizeof(total));
+    for_each_thread_stats(sum_thread_trace, &total);
+    size_t *events = total.events;
+
+    size_t mallocs = 0;
+    for (int i = TRACE_MALLOC_SLAB; i <= TRACE_MALLOC_HEAP; i++) {
+        mallocs += events[i];
+    }
+    fprintf(out, "mallocs %28zu\n", mallocs);
+    for (int i = TRACE_MALLOC_SLAB; i <= TRACE_MALLOC_HEAP; i++) {
+        print_share(out, trace_names[i] + strlen("malloc "), events[i], mallocs);
+    }
+
+    size_t frees = 0;
+    for (int i = TRACE_FREE_SLAB; i <= TRACE_FREE_FREE_LIST; i++) {
+        frees += events[i];
+    }
+    fprintf(out, "frees %30zu\n", frees);
+    for (int i = TRACE_FREE_SLAB; i <= TRACE_FREE_FREE_LIST; i++) {
+        print_share(out, trace_names[i] + strlen("free "), events[i], frees);
+    }
+
+    size_t scans = events[TRACE_LIST_SCAN];
+    fprintf(out, "free list scans %20zu (%.2f blocks on average, %zu tree searches)\n", scans,
+            scans > 0 ? (double)total.scanned / scans : 0.0, events[TRACE_TREE_SEARCH]);
+    for (int i = 0; i < TRACE_SCAN_BUCKETS; i++) {
+        char name[32];
+        size_t low = i == 0 ? 0 : (size_t)1 << (i - 1);
+        if (i <= 1) {
+            snprintf(name, sizeof(name), "%zu blocks", low);
+        } else if (i == TRACE_SCAN_BUCKETS - 1) {
+            snprintf(name, sizeof(name), "%zu+ blocks", low);
+        } else {
+            snprintf(name, sizeof(name), "%zu-%zu blocks", low, low * 2 - 1);
+        }
+        print_share(out, name, total.scans[i], scans);
+    }
+
+    size_t flushes = events[TRACE_QUICK_FLUSH];
+    fprintf(out, "quick list flushes %17zu (%.2f blocks on average)\n", flushes,
+            flushes > 0 ? (double)total.flushed / flushes : 0.0);
+    fprintf(out, "coalescing sweeps %18zu\n", events[TRACE_COALESCE_SWEEP]);
+
+#ifdef DY_TRACE_LOG
+    for_each_thread_stats(dump_thread_log, out);
+#endif
+    return 0;
+}
+
+#else
+
+// Built without tracepoints
+int dy_trace_dump(FILE *out) {
+    dy_errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,252 @@
+#include "dyma_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dyma.h"
+
+/*
+ * Free blocks of at least the tree threshold are indexed by a red-black tree per arena, in
+ * addition to being in their free list. The tree is ordered by size and then by address (so
+ * every key is unique), which gives O(log n) best fit lookups however many large free blocks
+ * there are. Nodes live inside the free blocks themselves, right after the free list links.
+ */
+
+#define LEFT(bp) (TREE_NODE(bp)->left)
+#define RIGHT(bp) (TREE_NODE(bp)->right)
+#define PARENT(bp) (TREE_NODE(bp)->parent)
+#define IS_RED(bp) ((bp) != NULL && TREE_NODE(bp)->red)
+
+// Check if block a comes before block b in the tree
+static bool tree_less(dy_block *a, dy_block *b) {
+    size_t sizeA = GET_SIZE(a);
+    size_t sizeB = GET_SIZE(b);
+    return sizeA < sizeB || (sizeA == sizeB && a < b);
+}
+
+// Replace the child old of parent (or the root) with new
+static void tree_replace_child(dy_arena *arena, dy_block *parent, dy_block *old, dy_block *new) {
+    if (parent == NULL) {
+        arena->tree_root = new;
+    } else if (LEFT(parent) == old) {
+        LEFT(parent) = new;
+    } else {
+        RIGHT(parent) = new;
+    }
+    if (new != NULL) {
+        PARENT(new) = parent;
+    }
+}
+
+// Rotate the subtree rooted at block to the left
+static void tree_rotate_left(dy_arena *arena, dy_block *block) {
+    dy_block *right = RIGHT(block);
+    RIGHT(block) = LEFT(right);
+    if (LEFT(right) != NULL) {
+        PARENT(LEFT(right)) = block;
+    }
+    tree_replace_child(arena, PARENT(block), block, right);
+    LEFT(right) = block;
+    PARENT(block) = right;
+}
+
+// Rotate the subtree rooted at block to the right
+static void tree_rotate_right(dy_arena *arena, dy_block *block) {
+    dy_block *left = LEFT(block);
+    LEFT(block) = RIGHT(left);
+    if (RIGHT(left) != NULL) {
+        PARENT(RIGHT(left)) = block;
+    }
+    tree_replace_child(arena, PARENT(block), block, left);
+    RIGHT(left) = block;
+    PARENT(block) = left;
+}
+
+/**
+ * Insert a free block into the best fit tree of an arena (arena lock must be held).
+ * @param arena The arena owning the block.
+ * @param block The block to insert, at least TREE_MIN_BLOCK_SIZE bytes.
+ */
+void tree_insert_block(dy_arena *arena, dy_block *block) {
+    // Find the leaf to attach the block to
+    dy_block *parent = NULL;
+    dy_block *node = arena->tree_root;
+    while (node != NULL) {
+        parent = node;
+        node = tree_less(block, node) ? LEFT(node) : RIGHT(node);
+    }
+    LEFT(block) = NULL;
+    RIGHT(block) = NULL;
+    PARENT(block) = parent;
+    TREE_NODE(block)->red = 1;
+    if (parent == NULL) {
+        arena->tree_root = block;
+    } else if (tree_less(block, parent)) {
+        LEFT(parent) = block;
+    } else {
+        RIGHT(parent) = block;
+    }
+
+    // Restore the red-black properties, moving up while a red node has a red parent
+    node = block;
+    while (IS_RED(PARENT(node))) {
+        parent = PARENT(node);
+        dy_block *grandparent = PARENT(parent);
+        if (parent == LEFT(grandparent)) {
+            dy_block *uncle = RIGHT(grandparent);
+            if (IS_RED(uncle)) {
+                TREE_NODE(parent)->red = 0;
+                TREE_NODE(uncle)->red = 0;
+                TREE_NODE(grandparent)->red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == RIGHT(parent)) {
+                tree_rotate_left(arena, parent);
+                node = parent;
+                parent = PARENT(node);
+            }
+            TREE_NODE(parent)->red = 0;
+            TREE_NODE(grandparent)->red = 1;
+            tree_rotate_right(arena, grandparent);
+        } else {
+            dy_block *uncle = LEFT(grandparent);
+            if (IS_RED(uncle)) {
+                TREE_NODE(parent)->red = 0;
+                TREE_NODE(uncle)->red = 0;
+                TREE_NODE(grandparent)->red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == LEFT(parent)) {
+                tree_rotate_right(arena, parent);
+                node = parent;
+                parent = PARENT(node);
+            }
+            TREE_NODE(parent)->red = 0;
+            TREE_NODE(grandparent)->red = 1;
+            tree_rotate_left(arena, grandparent);
+        }
+    }
+    TREE_NODE(arena->tree_root)->red = 0;
+}
+
+/**
+ * Remove a free block from the best fit tree of an arena (arena lock must be held).
+ * @param arena The arena owning the block.
+ * @param block The block to remove, its size must not have changed since it was inserted.
+ */
+void tree_remove_block(dy_arena *arena, dy_block *block) {
+    dy_block *child;
+    dy_block *parent;
+    bool removedRed;
+
+    if (LEFT(block) == NULL || RIGHT(block) == NULL) {
+        // At most one child, which takes the place of the block
+        child = LEFT(block) != NULL ? LEFT(block) : RIGHT(block);
+        parent = PARENT(block);
+        removedRed = TREE_NODE(block)->red;
+        tree_replace_child(arena, parent, block, child);
+    } else {
+        // Two children, the successor (leftmost of the right subtree) takes the place of the block
+        dy_block *successor = RIGHT(block);
+        while (LEFT(successor) != NULL) {
+            successor = LEFT(successor);
+        }
+        child = RIGHT(successor);
+        removedRed = TREE_NODE(successor)->red;
+        if (PARENT(successor) == block) {
+            parent = successor;
+        } else {
+            parent = PARENT(successor);
+            tree_replace_child(arena, parent, successor, child);
+            RIGHT(successor) = RIGHT(block);
+            PARENT(RIGHT(successor)) = successor;
+        }
+        tree_replace_child(arena, PARENT(block), block, successor);
+        LEFT(successor) = LEFT(block);
+        PARENT(LEFT(successor)) = successor;
+        TREE_NODE(successor)->red = TREE_NODE(block)->red;
+    }
+
+    if (removedRed) {
+        return;
+    }
+
+    // A black node was removed, push the missing black up until it can be absorbed
+    while (child != arena->tree_root && !IS_RED(child)) {
+        if (child == LEFT(parent)) {
+            dy_block *sibling = RIGHT(parent);
+            if (IS_RED(sibling)) {
+                TREE_NODE(sibling)->red = 0;
+                TREE_NODE(parent)->red = 1;
+                tree_rotate_left(arena, parent);
+                sibling = RIGHT(parent);
+            }
+            if (!IS_RED(LEFT(sibling)) && !IS_RED(RIGHT(sibling))) {
+                TREE_NODE(sibling)->red = 1;
+                child = parent;
+                parent = PARENT(child);
+                continue;
+            }
+            if (!IS_RED(RIGHT(sibling))) {
+                TREE_NODE(LEFT(sibling))->red = 0;
+                TREE_NODE(sibling)->red = 1;
+                tree_rotate_right(arena, sibling);
+                sibling = RIGHT(parent);
+            }
+            TREE_NODE(sibling)->red = TREE_NODE(parent)->red;
+            TREE_NODE(parent)->red = 0;
+            TREE_NODE(RIGHT(sibling))->red = 0;
+            tree_rotate_left(arena, parent);
+        } else {
+            dy_block *sibling = LEFT(parent);
+            if (IS_RED(sibling)) {
+                TREE_NODE(sibling)->red = 0;
+                TREE_NODE(parent)->red = 1;
+                tree_rotate_right(arena, parent);
+                sibling = LEFT(parent);
+            }
+            if (!IS_RED(LEFT(sibling)) && !IS_RED(RIGHT(sibling))) {
+                TREE_NODE(sibling)->red = 1;
+                child = parent;
+                parent = PARENT(child);
+                continue;
+            }
+            if (!IS_RED(LEFT(sibling))) {
+                TREE_NODE(RIGHT(sibling))->red = 0;
+                TREE_NODE(sibling)->red = 1;
+                tree_rotate_left(arena, sibling);
+                sibling = LEFT(parent);
+            }
+            TREE_NODE(sibling)->red = TREE_NODE(parent)->red;
+            TREE_NODE(parent)->red = 0;
+            TREE_NODE(LEFT(sibling))->red = 0;
+            tree_rotate_right(arena, parent);
+        }
+        child = arena->tree_root;
+    }
+    if (child != NULL) {
+        TREE_NODE(child)->red = 0;
+    }
+}
+
+/**
+ * Find the best fitting free block in the tree of an arena (arena lock must be held).
+ * @param arena The arena to search.
+ * @param size The minimum size of the block.
+ * @return The smallest block of at least size bytes (the lowest addressed among equals), or NULL if there is none.
+ */
+dy_block *tree_find_best_fit(dy_arena *arena, size_t size) {
+    dy_block *best = NULL;
+    dy_block *node = arena->tree_root;
+    while (node != NULL) {
+        if (GET_SIZE(node) >= size) {
+            best = node;
+            node = LEFT(node);
+        } else {
+            node = RIGHT(node);
+        }
+    }
+    return best;
+}
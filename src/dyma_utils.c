@@ -1,13 +1,126 @@
 #include "dyma_utils.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "dyma.h"
 
-static int heap_initialized = 0;
+__thread dy_quick_list dy_quick_lists[NUM_QUICK_LISTS];
+
+dy_arena dy_arenas[DY_NUM_ARENAS];
+
+// Tunable parameters, see dy_mallopt
+dy_params dy_config = {
+    .grow_pages = 1,
+    .grow_percent = 0,
+#ifdef DY_MEM_MMAP
+    .mmap_threshold = 1 << 20,
+#else
+    .mmap_threshold = 0,
+#endif
+    .tree_threshold = 1024,
+    .slab_max = 0,
+    .quick_budget = 1 << 20,
+    .placement = DY_PLACE_FIRST_FIT,
+    .fit_candidates = 4,
+    .coalesce_batch = 0,
+    .trim_threshold = 128 * 1024,
+    .top_pad = 128 * 1024,
+    .profile_rate = 0,
+};
+
+// Thread to arena assignment (round robin in order of first use)
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static int next_arena = 0;
+static __thread dy_arena *thread_arena = NULL;
+
+// Thread exit handling, used to return a thread's quick lists to the shared free lists
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+// Bytes that quick lists of all threads can hold beyond QUICK_LIST_MAX blocks, limited by the quick list budget
+static size_t quick_list_grown = 0;
+
+#ifdef DY_TLSF
+
+// Sizes below this share the first level 0, split into second levels of MIN_BLOCK_SIZE each
+#define TLSF_SMALL_SIZE ((size_t)MIN_BLOCK_SIZE << TLSF_SL_LOG2)
+
+// Position of the highest set bit of a non-zero size
+static int highest_bit(size_t size) {
+    return (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(size);
+}
+
+// Calculate the index of the free list a block of the given size is inserted into
+int calc_free_list_index(size_t size) {
+    if (size < TLSF_SMALL_SIZE) {
+        return size / MIN_BLOCK_SIZE;
+    }
+    int bit = highest_bit(size);
+    int fl = bit - highest_bit(TLSF_SMALL_SIZE) + 1;
+    int sl = (size >> (bit - TLSF_SL_LOG2)) - TLSF_SL_COUNT;
+    // Sizes beyond the last first level all share the last free list
+    if (fl >= TLSF_FL_COUNT) {
+        return NUM_FREE_LISTS - 1;
+    }
+    return fl * TLSF_SL_COUNT + sl;
+}
+
+// Calculate the minimum index of a free list whose blocks are all at least the given size
+int calc_min_free_list_index(size_t size) {
+    // Round the size up to the start of the next second level, unless it is already at one
+    size_t granularity = MIN_BLOCK_SIZE;
+    if (size >= TLSF_SMALL_SIZE) {
+        granularity = (size_t)1 << (highest_bit(size) - TLSF_SL_LOG2);
+    }
+    return calc_free_list_index(size + granularity - 1);
+}
+
+// Mark a free list as non-empty
+static void mark_free_list(dy_arena *arena, int index) {
+    int fl = index / TLSF_SL_COUNT;
+    arena->sl_bitmaps[fl] |= 1u << (index % TLSF_SL_COUNT);
+    arena->free_list_bitmap |= 1u << fl;
+}
+
+// Mark a free list as empty
+static void unmark_free_list(dy_arena *arena, int index) {
+    int fl = index / TLSF_SL_COUNT;
+    arena->sl_bitmaps[fl] &= ~(1u << (index % TLSF_SL_COUNT));
+    if (arena->sl_bitmaps[fl] == 0) {
+        arena->free_list_bitmap &= ~(1u << fl);
+    }
+}
+
+/**
+ * Find the first non-empty free list at or after an index, in constant time.
+ * @param arena The arena to search.
+ * @param index The index to start from.
+ * @return The index of the free list, or -1 if all of them are empty.
+ */
+int find_free_list(dy_arena *arena, int index) {
+    int fl = index / TLSF_SL_COUNT;
+    if (fl >= TLSF_FL_COUNT) {
+        return -1;
+    }
+    // Look for a non-empty second level in the same first level
+    unsigned int slMap = arena->sl_bitmaps[fl] & (~0u << (index % TLSF_SL_COUNT));
+    if (slMap == 0) {
+        // Otherwise take the first non-empty second level of the next non-empty first level
+        unsigned int flMap = fl + 1 < TLSF_FL_COUNT ? arena->free_list_bitmap & (~0u << (fl + 1)) : 0;
+        if (flMap == 0) {
+            return -1;
+        }
+        fl = __builtin_ctz(flMap);
+        slMap = arena->sl_bitmaps[fl];
+    }
+    return fl * TLSF_SL_COUNT + __builtin_ctz(slMap);
+}
+
+#else
 
 // Calculate the minimum index for a block to be inserted into / retrieved from the free list
 int calc_min_free_list_index(size_t size) {
@@ -17,20 +130,51 @@ int calc_min_free_list_index(size_t size) {
     }
     // Divide by size by MIN_BLOCK_SIZE
     size = (size - 1) / MIN_BLOCK_SIZE;
-    // Find the minimum index
-    for (int i = 1; i < NUM_FREE_LISTS; i++) {
-        if (size <= 1) {
-            return i;
-        } else {
-            size >>= 1;
-        }
+    // The index is one more than the position of the highest set bit
+    int index = 1 + (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(size);
+    if (index >= NUM_FREE_LISTS) {
+        return NUM_FREE_LISTS - 1;
+    }
+    return index;
+}
+
+// Calculate the index of the free list a block of the given size is inserted into
+int calc_free_list_index(size_t size) {
+    return calc_min_free_list_index(size);
+}
+
+// Mark a free list as non-empty
+static void mark_free_list(dy_arena *arena, int index) {
+    arena->free_list_bitmap |= 1u << index;
+}
+
+// Mark a free list as empty
+static void unmark_free_list(dy_arena *arena, int index) {
+    arena->free_list_bitmap &= ~(1u << index);
+}
+
+/**
+ * Find the first non-empty free list at or after an index, using count trailing zeros.
+ * @param arena The arena to search.
+ * @param index The index to start from.
+ * @return The index of the free list, or -1 if all of them are empty.
+ */
+int find_free_list(dy_arena *arena, int index) {
+    if (index >= NUM_FREE_LISTS) {
+        return -1;
     }
-    return NUM_FREE_LISTS - 1;
+    unsigned int nonEmpty = arena->free_list_bitmap & (~0u << index);
+    if (nonEmpty == 0) {
+        return -1;
+    }
+    return __builtin_ctz(nonEmpty);
 }
 
+#endif
+
 // Calculate the index for a block to be inserted into / retrieved from the quick list
 int calc_quick_list_index(size_t size) {
-    int index = (size - MIN_BLOCK_SIZE) / ROW_SIZE;
+    int index = (size - MIN_ALLOC_BLOCK_SIZE) / ROW_SIZE;
     // Check if index is out of bounds
     if (index >= NUM_QUICK_LISTS) {
         return -1;
@@ -41,9 +185,9 @@ int calc_quick_list_index(size_t size) {
 // Calculate block size for a given payload size
 size_t calc_block_size(size_t size) {
     // Calculate necessary block size
-    size_t blockSize = size + 8;
-    if (blockSize < 32) {
-        blockSize = 32;
+    size_t blockSize = size + HEADER_SIZE;
+    if (blockSize < MIN_ALLOC_BLOCK_SIZE) {
+        blockSize = MIN_ALLOC_BLOCK_SIZE;
     } else {
         blockSize = blockSize - 1;
         blockSize = blockSize + (8 - (blockSize % 8));
@@ -65,26 +209,118 @@ dy_block *create_block(void *start, size_t size) {
     return block;
 }
 
-// Insert a block into the free list
-void insert_block_free_list(dy_block *block) {
+// Push a fragment onto the fragment list of an arena
+static void insert_fragment(dy_arena *arena, dy_block *block) {
+    void *start = arena->base;
+    uint32_t row = ((void *)block - start) / ROW_SIZE;
+    FRAGMENT_LINKS(block)->next = arena->fragments;
+    FRAGMENT_LINKS(block)->prev = 0;
+    if (arena->fragments != 0) {
+        FRAGMENT_LINKS((dy_block *)(start + (size_t)arena->fragments * ROW_SIZE))->prev = row;
+    }
+    arena->fragments = row;
+    arena->fragment_blocks++;
+    arena->free_bytes += GET_SIZE(block);
+}
+
+// Remove a fragment from the fragment list of an arena
+static void remove_fragment(dy_arena *arena, dy_block *block) {
+    void *start = arena->base;
+    uint32_t next = FRAGMENT_LINKS(block)->next;
+    uint32_t prev = FRAGMENT_LINKS(block)->prev;
+    if (prev != 0) {
+        FRAGMENT_LINKS((dy_block *)(start + (size_t)prev * ROW_SIZE))->next = next;
+    } else {
+        arena->fragments = next;
+    }
+    if (next != 0) {
+        FRAGMENT_LINKS((dy_block *)(start + (size_t)next * ROW_SIZE))->prev = prev;
+    }
+    arena->fragment_blocks--;
+    arena->free_bytes -= GET_SIZE(block);
+}
+
+// Insert a block into the free list of an arena
+void insert_block_free_list(dy_arena *arena, dy_block *block) {
     // Get size of block
     size_t size = GET_SIZE(block);
+    // The block at the end of the heap becomes the top chunk, only carved when no free block fits
+    if ((void *)block + size == EPILOGUE(arena->base + arena->heap_bytes)) {
+        arena->top = block;
+        arena->free_bytes += size;
+        return;
+    }
+    if (IS_FRAGMENT(size)) {
+        insert_fragment(arena, block);
+        return;
+    }
     // Get index of free list
-    int index = calc_min_free_list_index(size);
-    // Insert block at head of free list
-    dy_block *head = dy_free_list_heads[index].body.links.next;
-    block->body.links.next = head;
-    block->body.links.prev = &dy_free_list_heads[index];
-    head->body.links.prev = block;
-    dy_free_list_heads[index].body.links.next = block;
+    int index = calc_free_list_index(size);
+    // Insert block at head of free list, or before the first block at a higher address to keep the list in address order
+    dy_block *prev = &arena->free_list_heads[index];
+    if (arena->placement == DY_PLACE_ADDRESS_FIT) {
+        while (NEXT_FREE(arena, prev) != &arena->free_list_heads[index] && NEXT_FREE(arena, prev) < block) {
+            prev = NEXT_FREE(arena, prev);
+        }
+    }
+    dy_block *next = NEXT_FREE(arena, prev);
+    SET_NEXT_FREE(arena, block, next);
+    SET_PREV_FREE(arena, block, prev);
+    SET_PREV_FREE(arena, next, block);
+    SET_NEXT_FREE(arena, prev, block);
+    // Mark free list as non-empty
+    mark_free_list(arena, index);
+    arena->free_list_blocks[index]++;
+    arena->free_list_bytes[index] += size;
+    arena->free_bytes += size;
+    // Index large blocks for best fit
+    if (IN_TREE(arena, size)) {
+        tree_insert_block(arena, block);
+    }
+}
+
+// Remove a block from the free list of an arena
+void remove_block_free_list(dy_arena *arena, dy_block *block) {
+    if (block == arena->top) {
+        arena->top = NULL;
+        arena->free_bytes -= GET_SIZE(block);
+        return;
+    }
+    if (IS_FRAGMENT(GET_SIZE(block))) {
+        remove_fragment(arena, block);
+        return;
+    }
+    // Splice out block from free list
+    dy_block *prev = PREV_FREE(arena, block);
+    dy_block *next = NEXT_FREE(arena, block);
+    SET_NEXT_FREE(arena, prev, next);
+    SET_PREV_FREE(arena, next, prev);
+    // Set next and prev to NULL
+    block->body.links.next = NULL_LINK;
+    block->body.links.prev = NULL_LINK;
+    // Mark free list as empty if the block was the last one (only the sentinel is left)
+    int index = calc_free_list_index(GET_SIZE(block));
+    if (prev == next && NEXT_FREE(arena, prev) == prev) {
+        unmark_free_list(arena, index);
+    }
+    // Move the rover past the block, back to the head if it was the last block
+    if (arena->rovers[index] == block) {
+        arena->rovers[index] = next != &arena->free_list_heads[index] ? next : NULL;
+    }
+    arena->free_list_blocks[index]--;
+    arena->free_list_bytes[index] -= GET_SIZE(block);
+    arena->free_bytes -= GET_SIZE(block);
+    if (IN_TREE(arena, GET_SIZE(block))) {
+        tree_remove_block(arena, block);
+    }
 }
 
 // Split a block into two blocks (if possible)
 dy_block *split_block(dy_block *block, size_t size) {
     // Get size of block
     size_t blockSize = GET_SIZE(block);
-    // Check if block can be split
-    if (blockSize - size < MIN_BLOCK_SIZE) {
+    // Check if block can be split (a remainder below MIN_BLOCK_SIZE becomes a fragment)
+    if (blockSize - size < MIN_ALLOC_BLOCK_SIZE) {
         return NULL;
     }
     // Create new block
@@ -121,27 +357,20 @@ void dealloc_block(dy_block *block) {
     // Clear prev_alloc bit of next block
     dy_block *nextBlock = (void *)block + GET_SIZE(block);
     CLEAR_PREV_ALLOC(nextBlock);
-    // Next block cannot be free since we would have coalesced it, so no need to copy header into footer
+    // Next block can only be free when coalescing is deferred, and its footer does not record prev_alloc
 }
 
 // Coalesce a block with its predecessor
-dy_block *coalesce_prev_block(dy_block *block) {
+dy_block *coalesce_prev_block(dy_arena *arena, dy_block *block) {
     // Get size of block
     size_t size = GET_SIZE(block);
     // Get size of previous block
-    dy_footer *prevFooter = ((void *)block - ROW_SIZE);
+    dy_footer *prevFooter = ((void *)block - FOOTER_SIZE);
     size_t prevSize = *prevFooter & ~0x7;
-    // Check if previous block was in free list
+    // Check if previous block was in free list or the top chunk
     dy_block *prevBlock = (void *)block - prevSize;
-    if (prevBlock->body.links.next != NULL && prevBlock->body.links.prev != NULL) {
-        // Splice out block from free list
-        dy_block *prev = prevBlock->body.links.prev;
-        dy_block *next = prevBlock->body.links.next;
-        prev->body.links.next = next;
-        next->body.links.prev = prev;
-        // Set next and prev to NULL
-        prevBlock->body.links.next = NULL;
-        prevBlock->body.links.prev = NULL;
+    if (IS_FRAGMENT(prevSize) || IS_LINKED(prevBlock) || prevBlock == arena->top) {
+        remove_block_free_list(arena, prevBlock);
     }
     // Check if previous block had prev_alloc bit set
     size_t prevAlloc = GET_PREV_ALLOC(prevBlock);
@@ -156,22 +385,15 @@ dy_block *coalesce_prev_block(dy_block *block) {
 }
 
 // Coalesce a block with its successor
-dy_block *coalesce_next_block(dy_block *block) {
+dy_block *coalesce_next_block(dy_arena *arena, dy_block *block) {
     // Get size of block
     size_t size = GET_SIZE(block);
     // Get size of next block
     dy_block *nextBlock = (void *)block + size;
     size_t nextSize = GET_SIZE(nextBlock);
-    // Check if next block was in free list
-    if (nextBlock->body.links.next != NULL && nextBlock->body.links.prev != NULL) {
-        // Splice out block from free list
-        dy_block *prev = nextBlock->body.links.prev;
-        dy_block *next = nextBlock->body.links.next;
-        prev->body.links.next = next;
-        next->body.links.prev = prev;
-        // Set next and prev to NULL
-        nextBlock->body.links.next = NULL;
-        nextBlock->body.links.prev = NULL;
+    // Check if next block was in free list or the top chunk
+    if (IS_FRAGMENT(nextSize) || IS_LINKED(nextBlock) || nextBlock == arena->top) {
+        remove_block_free_list(arena, nextBlock);
     }
     // Check if original block had prev_alloc bit set
     size_t prevAlloc = GET_PREV_ALLOC(block);
@@ -185,66 +407,243 @@ dy_block *coalesce_next_block(dy_block *block) {
     return newBlock;
 }
 
-// Flush a quick list
+// Return blocks taken off a quick list to the free lists. The blocks are sorted by address so that
+// each arena is locked once, and runs of adjacent blocks are merged and coalesced as one block.
+static void free_quick_list_blocks(dy_block *blocks[], int count) {
+    // Insertion sort, there are at most QUICK_LIST_LIMIT blocks
+    for (int i = 1; i < count; i++) {
+        dy_block *block = blocks[i];
+        int j = i;
+        while (j > 0 && blocks[j - 1] > block) {
+            blocks[j] = blocks[j - 1];
+            j--;
+        }
+        blocks[j] = block;
+    }
+
+    dy_arena *locked = NULL;
+    for (int i = 0; i < count; i++) {
+        dy_block *block = blocks[i];
+        // Lock the arena owning the block (blocks freed by other threads may come from other arenas)
+        dy_arena *arena = get_block_arena(block);
+        if (arena != locked) {
+            if (locked != NULL) {
+                unlock_arena(locked);
+            }
+            lock_arena(arena);
+            locked = arena;
+        }
+        // Merge the run of blocks starting here into one block
+        size_t size = GET_SIZE(block);
+        while (i + 1 < count && (void *)block + size == (void *)blocks[i + 1]) {
+            size += GET_SIZE(blocks[i + 1]);
+            i++;
+        }
+        // Clear quick list bit
+        CLEAR_IN_QUICK_LIST(block);
+        SET_SIZE(block, size);
+        // Coalesce, deallocate and insert block into free list
+        free_to_free_list(arena, block);
+    }
+    if (locked != NULL) {
+        unlock_arena(locked);
+    }
+}
+
+// Evict the oldest blocks of a quick list (at its tail) back to the free lists
+void evict_quick_list(int index, int count) {
+    dy_quick_list *list = &dy_quick_lists[index];
+    if (count > list->length) {
+        count = list->length;
+    }
+    if (count <= 0) {
+        return;
+    }
+
+    // Find the link to the first block to evict, the newest blocks before it are kept
+    dy_block **link = &list->first;
+    for (int i = 0; i < list->length - count; i++) {
+        link = &QUICK_NEXT(*link);
+    }
+    dy_block *head = *link;
+    *link = NULL;
+    list->length -= count;
+    TRACE_FLUSH(count);
+
+    // Free the evicted blocks in batches
+    dy_block *blocks[QUICK_LIST_LIMIT];
+    int batched = 0;
+    while (head != NULL) {
+        blocks[batched++] = head;
+        head = QUICK_NEXT(head);
+        if (batched == QUICK_LIST_LIMIT || head == NULL) {
+            free_quick_list_blocks(blocks, batched);
+            batched = 0;
+        }
+    }
+}
+
+// Flush every block of a quick list back to the free lists
 void flush_quick_list(int index) {
-    // Get head of quick list
-    dy_block *head = dy_quick_lists[index].first;
-    // Iterate through quick list
-    while ((void *)head != &dy_quick_lists[index] && head != NULL) {
-        // Get next block
-        dy_block *next = head->body.links.next;
-        // Check if previous block is free and coalesce
-        if (!GET_PREV_ALLOC(head)) {
-            head = coalesce_prev_block(head);
+    evict_quick_list(index, dy_quick_lists[index].length);
+}
+
+// Initialize the arena locks and assign each arena its own heap
+static void init_arenas() {
+    for (int i = 0; i < DY_NUM_ARENAS; i++) {
+        pthread_mutex_init(&dy_arenas[i].lock, NULL);
+        dy_arenas[i].heap = i;
+    }
+}
+
+// Get the arena assigned to the calling thread, assigning one if needed
+dy_arena *get_thread_arena() {
+    if (thread_arena == NULL) {
+        pthread_once(&arenas_once, init_arenas);
+        int index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % DY_NUM_ARENAS;
+        thread_arena = &dy_arenas[index];
+    }
+    return thread_arena;
+}
+
+// Get the arena owning a block, based on the heap the block lies in
+dy_arena *get_block_arena(dy_block *block) {
+    int heap = dy_mem_heap_index(block);
+    if (heap < 0 || heap >= DY_NUM_ARENAS) {
+        return NULL;
+    }
+    return &dy_arenas[heap];
+}
+
+// Acquire the lock protecting the free lists and the heap of an arena
+void lock_arena(dy_arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+}
+
+// Release the lock protecting the free lists and the heap of an arena
+void unlock_arena(dy_arena *arena) {
+    // The arena is consistent again, so update its peak usage
+    size_t used = arena->heap_bytes - arena->free_bytes;
+    if (used > arena->peak_used_bytes) {
+        arena->peak_used_bytes = used;
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Calculate the bytes a quick list of a given capacity holds beyond QUICK_LIST_MAX blocks
+static size_t calc_quick_list_grown(int index, int capacity) {
+    if (capacity <= QUICK_LIST_MAX) {
+        return 0;
+    }
+    return (size_t)(capacity - QUICK_LIST_MAX) * QUICK_LIST_BLOCK_SIZE(index);
+}
+
+// Update the capacity of a quick list from the counters of the last window of frees
+static void adapt_quick_list(int index) {
+    dy_quick_list *list = &dy_quick_lists[index];
+    size_t hits = list->stats.hits - list->window.hits;
+    size_t refills = list->stats.refills - list->window.refills;
+    size_t flushes = list->stats.flushes - list->window.flushes;
+    list->window = list->stats;
+
+    int capacity = list->capacity;
+    if (flushes > 0 && refills > 0) {
+        // Flushed blocks had to be split off the free lists again, so hold on to more of them
+        capacity = capacity * 2 > QUICK_LIST_LIMIT ? QUICK_LIST_LIMIT : capacity * 2;
+    } else if (hits == 0) {
+        // Nothing was reused, so give blocks back to the free lists sooner
+        capacity = capacity / 2 < QUICK_LIST_MIN ? QUICK_LIST_MIN : capacity / 2;
+    }
+
+    size_t oldGrown = calc_quick_list_grown(index, list->capacity);
+    size_t newGrown = calc_quick_list_grown(index, capacity);
+    if (newGrown > oldGrown) {
+        // Only grow while the quick lists of all threads stay within the budget
+        size_t grown = __atomic_add_fetch(&quick_list_grown, newGrown - oldGrown, __ATOMIC_RELAXED);
+        if (grown > dy_config.quick_budget) {
+            __atomic_sub_fetch(&quick_list_grown, newGrown - oldGrown, __ATOMIC_RELAXED);
+            return;
         }
-        // Check if next block is free and coalesce
-        if (!GET_ALLOC((dy_block *)((void *)head + GET_SIZE(head)))) {
-            head = coalesce_next_block(head);
+    } else if (newGrown < oldGrown) {
+        __atomic_sub_fetch(&quick_list_grown, oldGrown - newGrown, __ATOMIC_RELAXED);
+    }
+    list->capacity = capacity;
+}
+
+// Flush all quick lists of an exiting thread back to the free lists
+static void exit_thread(void *arg) {
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        if (dy_quick_lists[i].length > 0) {
+            flush_quick_list(i);
         }
-        // Deallocate block
-        dealloc_block(head);
-        // Insert block into free list
-        insert_block_free_list(head);
-        // Set head to next
-        head = next;
+        // Return the thread's share of the budget
+        __atomic_sub_fetch(&quick_list_grown, calc_quick_list_grown(i, dy_quick_lists[i].capacity), __ATOMIC_RELAXED);
     }
-    // Set length to 0 and first to NULL
-    dy_quick_lists[index].length = 0;
-    dy_quick_lists[index].first = NULL;
+    unregister_thread_stats();
+}
+
+// Create the key whose destructor flushes quick lists on thread exit
+static void create_thread_key() {
+    pthread_key_create(&thread_key, exit_thread);
+}
+
+// Set up the quick lists and counters of the calling thread, and make sure they are handed back when it exits
+void init_thread() {
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_setspecific(thread_key, dy_quick_lists);
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        dy_quick_lists[i].capacity = QUICK_LIST_MAX;
+    }
+    register_thread_stats();
+    dy_thread_counters.initialized = true;
 }
 
 /**
- * Initialize the heap and associated data structures.
+ * Initialize the heap of an arena and associated data structures.
+ * @param arena The arena to initialize.
  * @return 0 on success, -1 on failure.
  */
-int init_heap() {
+int init_heap(dy_arena *arena) {
     // Check if heap is already initialized
-    if (heap_initialized) {
+    if (__atomic_load_n(&arena->initialized, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    // Check again while holding the lock, another thread may have won the race
+    lock_arena(arena);
+    if (arena->initialized) {
+        unlock_arena(arena);
         return 0;
     }
 
-    // Get page of memory
-    void *page = dy_mem_grow();
+    // Get initial pages of memory
+    void *page = dy_mem_heap_grow(arena->heap, calc_grow_pages(arena, 1));
     if (page == NULL) {
         // If page is NULL, no memory could be allocated
+        unlock_arena(arena);
         dy_errno = ENOMEM;
         return -1;
     }
-    void *pageEnd = dy_mem_end();
+    void *pageEnd = dy_mem_heap_end(arena->heap);
+    arena->heap_bytes = pageEnd - page;
+    arena->base = page;
 
     // Create prologue block
-    dy_block *prologue = page;
+    dy_block *prologue = PROLOGUE(page);
 
     // Initialize prologue header
     CLEAR_HEADER(prologue);
     SET_ALLOC(prologue);
-    SET_SIZE(prologue, MIN_BLOCK_SIZE);
+    SET_SIZE(prologue, PROLOGUE_SIZE);
 
     // Set payload to all 0s
-    memset(prologue->body.payload, 0, MIN_BLOCK_SIZE - ROW_SIZE);
+    memset(prologue->body.payload, 0, PROLOGUE_SIZE - HEADER_SIZE);
+#ifdef DY_COMPACT
+    arena->free_list_heads = (dy_block *)prologue->body.payload;
+#endif
 
     // Create epilogue block
-    dy_block *epilogue = (void *)pageEnd - ROW_SIZE;
+    dy_block *epilogue = EPILOGUE(pageEnd);
 
     // Initialize epilogue header
     CLEAR_HEADER(epilogue);
@@ -253,27 +652,42 @@ int init_heap() {
 
     // Initialize free lists
     for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        dy_free_list_heads[i].body.links.next = &dy_free_list_heads[i];
-        dy_free_list_heads[i].body.links.prev = &dy_free_list_heads[i];
+        SET_NEXT_FREE(arena, &arena->free_list_heads[i], &arena->free_list_heads[i]);
+        SET_PREV_FREE(arena, &arena->free_list_heads[i], &arena->free_list_heads[i]);
     }
-
-    // Initialize quick lists
-    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
-        dy_quick_lists[i].length = 0;
-        dy_quick_lists[i].first = NULL;
+    arena->free_list_bitmap = 0;
+    arena->tree_root = NULL;
+    arena->top = NULL;
+    arena->tree_threshold = dy_config.tree_threshold;
+    arena->placement = dy_config.placement;
+    arena->fit_candidates = dy_config.fit_candidates;
+    arena->coalesce_batch = dy_config.coalesce_batch;
+    arena->deferred_frees = 0;
+    arena->fragments = 0;
+    arena->fragment_blocks = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        arena->rovers[i] = NULL;
     }
+#ifdef DY_TLSF
+    for (int i = 0; i < TLSF_FL_COUNT; i++) {
+        arena->sl_bitmaps[i] = 0;
+    }
+#endif
+
+    // Quick lists are thread local and start out zeroed, so they need no initialization
 
     // Create block from remaining memory
-    size_t size = (size_t)(pageEnd - page) - MIN_BLOCK_SIZE - ROW_SIZE;
-    dy_block *free = create_block(page + MIN_BLOCK_SIZE, size);
+    size_t size = (size_t)(pageEnd - page) - HEAP_OVERHEAD;
+    dy_block *free = create_block(FIRST_BLOCK(page), size);
     
     // Previous block should be set to allocated
     SET_PREV_ALLOC(free);
 
     // Insert first free block into free list
-    insert_block_free_list(free);
+    insert_block_free_list(arena, free);
 
-    heap_initialized = 1;
+    __atomic_store_n(&arena->initialized, 1, __ATOMIC_RELEASE);
+    unlock_arena(arena);
     return 0;
 }
 
@@ -293,6 +707,10 @@ dy_block *get_quick_list_block(size_t block_size) {
 
     // Check if quick list is empty
     if (dy_quick_lists[index].length == 0) {
+        dy_quick_lists[index].stats.misses++;
+        if (dy_quick_lists[index].stats.flushes > 0) {
+            dy_quick_lists[index].stats.refills++;
+        }
         return NULL;
     }
 
@@ -300,12 +718,29 @@ dy_block *get_quick_list_block(size_t block_size) {
     dy_block *block = dy_quick_lists[index].first;
 
     // Remove block from quick list
-    dy_quick_lists[index].first = block->body.links.next;
+    dy_quick_lists[index].first = QUICK_NEXT(block);
     dy_quick_lists[index].length--;
+    dy_quick_lists[index].stats.hits++;
 
-    // Clear quick list bit
+    // Clear quick list bit (the block never stopped being allocated, so its neighbours are untouched)
     CLEAR_IN_QUICK_LIST(block);
 
+    // Return block
+    return block;
+}
+
+// Take a block out of the free list of an arena, split it and allocate it
+static dy_block *take_free_list_block(dy_arena *arena, dy_block *block, size_t block_size) {
+    // Splice out block from free list
+    remove_block_free_list(arena, block);
+
+    // Split block if possible
+    dy_block *split = split_block(block, block_size);
+    if (split != NULL) {
+        // Insert split block into free list
+        insert_block_free_list(arena, split);
+    }
+
     // Allocate block
     alloc_block(block);
 
@@ -313,109 +748,261 @@ dy_block *get_quick_list_block(size_t block_size) {
     return block;
 }
 
+// Find a block of at least block_size bytes in a free list according to the placement policy of the arena,
+// adding the number of blocks looked at to scanned
+static dy_block *find_free_list_block(dy_arena *arena, int index, size_t block_size, size_t *scanned) {
+    dy_block *head = &arena->free_list_heads[index];
+
+    if (arena->placement == DY_PLACE_NEXT_FIT) {
+        // Start where the last scan stopped, wrapping around to the head once
+        dy_block *start = arena->rovers[index] != NULL ? arena->rovers[index] : NEXT_FREE(arena, head);
+        dy_block *block = start;
+        do {
+            if (block != head) {
+                (*scanned)++;
+                if (GET_SIZE(block) >= block_size) {
+                    // The rover moves past the block when it is taken out of the list
+                    arena->rovers[index] = block;
+                    return block;
+                }
+            }
+            block = NEXT_FREE(arena, block);
+        } while (block != start);
+        return NULL;
+    }
+
+    if (arena->placement == DY_PLACE_BEST_OF_N) {
+        // Compare the first few blocks that fit, stopping early at an exact fit
+        dy_block *best = NULL;
+        size_t candidates = 0;
+        for (dy_block *block = NEXT_FREE(arena, head); block != head; block = NEXT_FREE(arena, block)) {
+            (*scanned)++;
+            size_t size = GET_SIZE(block);
+            if (size < block_size) {
+                continue;
+            }
+            if (best == NULL || size < GET_SIZE(best)) {
+                best = block;
+            }
+            if (size == block_size || ++candidates >= arena->fit_candidates) {
+                break;
+            }
+        }
+        return best;
+    }
+
+    // First fit, the order of the list makes it address-ordered first fit
+    for (dy_block *block = NEXT_FREE(arena, head); block != head; block = NEXT_FREE(arena, block)) {
+        (*scanned)++;
+        if (GET_SIZE(block) >= block_size) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
 /**
- * Get a block from the free list, if possible.
+ * Get a block from the free list of an arena, if possible (arena lock must be held).
+ * @param arena The arena to search.
  * @param block_size The minimum size of the block to get.
  * @return A pointer to the block, or NULL if no block was found.
  */
-dy_block *get_free_list_block(size_t block_size) {
-    // Get the minimum index for the free list
-    int index = calc_min_free_list_index(block_size);
+dy_block *get_free_list_block(dy_arena *arena, size_t block_size) {
+    // The smallest blocks fit fragments exactly
+    if (block_size == MIN_ALLOC_BLOCK_SIZE && arena->fragments != 0) {
+        dy_block *block = arena->base + (size_t)arena->fragments * ROW_SIZE;
+        return take_free_list_block(arena, block, block_size);
+    }
 
-    // Iterate through free lists
-    for (int i = index; i < NUM_FREE_LISTS; i++) {
-        // Check if free list is empty (sentinel node points to itself)
-        if (dy_free_list_heads[i].body.links.next == &dy_free_list_heads[i]) {
-            continue;
+    // Large blocks are all in the tree, so the best fitting one can be found directly
+    if (IN_TREE(arena, block_size)) {
+        TRACE(TRACE_TREE_SEARCH, block_size);
+        dy_block *block = tree_find_best_fit(arena, block_size);
+        if (block == NULL) {
+            // Deferred frees may have left neighbours that fit together, as in the free list search below
+            if (arena->deferred_frees > 0) {
+                coalesce_heap(arena);
+                return get_free_list_block(arena, block_size);
+            }
+            return NULL;
         }
+        return take_free_list_block(arena, block, block_size);
+    }
 
-        // Get first block in free list
-        dy_block *block = dy_free_list_heads[i].body.links.next;
+#ifdef DY_TLSF
+    // The search below skips the free list the size itself belongs to, as some of its blocks may be
+    // too small. Checking just its first block keeps the search constant time.
+    int exact = calc_free_list_index(block_size);
+    dy_block *first = NEXT_FREE(arena, &arena->free_list_heads[exact]);
+    if (first != &arena->free_list_heads[exact] && GET_SIZE(first) >= block_size) {
+        TRACE_SCAN(1);
+        return take_free_list_block(arena, first, block_size);
+    }
+#endif
 
-        // Check if block is large enough
-        while (block != &dy_free_list_heads[i] && GET_SIZE(block) < block_size) {
-            block = block->body.links.next;
-        }
-        if (block == &dy_free_list_heads[i]) {
+    // Get the minimum index for the free list
+    int index = calc_min_free_list_index(block_size);
+
+    // Iterate through the non-empty free lists, skipping empty ones using the bitmap
+    size_t scanned = 0;
+    for (int i = find_free_list(arena, index); i >= 0; i = find_free_list(arena, i + 1)) {
+        dy_block *block = find_free_list_block(arena, i, block_size, &scanned);
+        if (block == NULL) {
             continue;
         }
 
-        // Splice out block from free list
-        dy_block *next = block->body.links.next;
-        dy_block *prev = block->body.links.prev;
-        next->body.links.prev = prev;
-        prev->body.links.next = next;
-
-        // Split block if possible
-        dy_block *split = split_block(block, block_size);
-        if (split != NULL) {
-            // Insert split block into free list
-            insert_block_free_list(split);
-        }
+        TRACE_SCAN(scanned);
+        return take_free_list_block(arena, block, block_size);
+    }
 
-        // Allocate block
-        alloc_block(block);
+    TRACE_SCAN(scanned);
 
-        // Return block
-        return block;
+    // Deferred frees may have left neighbours that fit together, coalesce them and search again
+    if (arena->deferred_frees > 0) {
+        coalesce_heap(arena);
+        return get_free_list_block(arena, block_size);
     }
 
     // If no block was found, return NULL
     return NULL;
 }
 
+// Calculate how many pages to grow a heap by to get at least the needed number of pages
+size_t calc_grow_pages(dy_arena *arena, size_t needed) {
+    size_t pages = needed;
+    // Grow by at least the configured increment
+    if (pages < dy_config.grow_pages) {
+        pages = dy_config.grow_pages;
+    }
+    // Grow by at least a percentage of the current heap size (geometric growth)
+    if (dy_config.grow_percent > 0 && arena->initialized) {
+        size_t heapPages = (dy_mem_heap_end(arena->heap) - dy_mem_heap_start(arena->heap)) / PAGE_SZ;
+        size_t geometric = heapPages * dy_config.grow_percent / 100;
+        if (pages < geometric) {
+            pages = geometric;
+        }
+    }
+    return pages;
+}
+
+// Grow the heap of an arena by at least the needed number of pages and move its epilogue to the new end
+static void *extend_heap(dy_arena *arena, size_t needed) {
+    size_t pages = calc_grow_pages(arena, needed);
+    void *page = dy_mem_heap_grow(arena->heap, pages);
+    if (page == NULL && pages > needed) {
+        // The growth policy asked for more than is available, settle for what is needed
+        page = dy_mem_heap_grow(arena->heap, needed);
+    }
+    if (page == NULL) {
+        return NULL;
+    }
+
+    arena->heap_bytes = dy_mem_heap_end(arena->heap) - dy_mem_heap_start(arena->heap);
+
+    // Create new epilogue
+    dy_block *newEpilogue = EPILOGUE(dy_mem_heap_end(arena->heap));
+    CLEAR_HEADER(newEpilogue);
+    SET_ALLOC(newEpilogue);
+    SET_SIZE(newEpilogue, 0);
+    return page;
+}
+
+/**
+ * Give the end of the top chunk of an arena back to the memory backend (arena lock must be held).
+ * The heap is shrunk by whole pages, keeping at least pad bytes of the top chunk.
+ * @param arena The arena whose heap to shrink.
+ * @param pad The number of bytes of the top chunk to keep for future allocations.
+ * @return The number of bytes given back.
+ */
+size_t trim_heap(dy_arena *arena, size_t pad) {
+    // Deferred frees may have left free blocks in front of the top chunk
+    if (arena->deferred_frees > 0) {
+        coalesce_heap(arena);
+    }
+    dy_block *top = arena->top;
+    if (top == NULL) {
+        return 0;
+    }
+
+    // The new end leaves room for the padding and the epilogue, and a block too small to exist is kept whole
+    void *end = arena->base + arena->heap_bytes;
+    void *newEnd = (void *)(((uintptr_t)top + pad + HEADER_SIZE + PAGE_SZ - 1) & ~(uintptr_t)(PAGE_SZ - 1));
+    size_t topSize = (size_t)(newEnd - HEADER_SIZE - (void *)top);
+    if (topSize != 0 && topSize < MIN_ALLOC_BLOCK_SIZE) {
+        newEnd += PAGE_SZ;
+        topSize += PAGE_SZ;
+    }
+    if (newEnd >= end) {
+        return 0;
+    }
+
+    remove_block_free_list(arena, top);
+    dy_mem_heap_shrink(arena->heap, (size_t)(end - newEnd) / PAGE_SZ);
+    arena->heap_bytes = newEnd - arena->base;
+
+    // Create new epilogue
+    dy_block *epilogue = EPILOGUE(newEnd);
+    CLEAR_HEADER(epilogue);
+    SET_ALLOC(epilogue);
+    SET_SIZE(epilogue, 0);
+
+    // The block before the top chunk is allocated, it was coalesced otherwise
+    if (topSize == 0) {
+        SET_PREV_ALLOC(epilogue);
+    } else {
+        top = create_block(top, topSize);
+        SET_PREV_ALLOC(top);
+        insert_block_free_list(arena, top);
+    }
+    return (size_t)(end - newEnd);
+}
+
 /**
- * Get a block from the heap, if possible.
+ * Get a block from the heap of an arena, if possible (arena lock must be held).
+ * The heap is grown once, by exactly as many pages as needed (or more, according to the growth policy).
+ * If the top chunk already fits, it is carved without growing the heap.
+ * @param arena The arena whose heap to grow.
  * @param block_size The minimum size of the block to get.
  * @return A pointer to the block, or NULL if no block was found.
  */
-dy_block *get_heap_block(size_t block_size) {
-    dy_block *block = NULL;
-    do {
-        // Get new page of memory
-        void *page = dy_mem_grow();
+dy_block *get_heap_block(dy_arena *arena, size_t block_size) {
+    // The top chunk, if there is one, will be coalesced with the new memory
+    dy_block *epilogue = EPILOGUE(dy_mem_heap_end(arena->heap));
+    bool prevAlloc = arena->top == NULL;
+    size_t available = prevAlloc ? 0 : GET_SIZE(arena->top);
+
+    dy_block *block;
+    if (available >= block_size) {
+        // The top chunk already fits
+        block = arena->top;
+        remove_block_free_list(arena, block);
+    } else {
+        // Grow the heap by the number of pages needed in one step
+        void *page = extend_heap(arena, (block_size - available + PAGE_SZ - 1) / PAGE_SZ);
         if (page == NULL) {
             // If page is NULL, no memory could be allocated
-            // If the current block is large enough, at least add it to the free list
-            if (block != NULL) {
-                // Copy header into footer
-                dy_footer *footer = GET_FOOTER_PTR(block);
-                *footer = (dy_footer)block->header;
-                insert_block_free_list(block);
-            }
             dy_errno = ENOMEM;
             return NULL;
         }
-        void *pageEnd = dy_mem_end();
-
-        // Get whether the previous block was allocated
-        dy_block *epilogue = page - ROW_SIZE;
-        bool prevAlloc = GET_PREV_ALLOC(epilogue);
+        void *pageEnd = dy_mem_heap_end(arena->heap);
 
-        // Create new epilogue
-        dy_block *newEpilogue = pageEnd - ROW_SIZE;
-        CLEAR_HEADER(newEpilogue);
-        SET_ALLOC(newEpilogue);
-        SET_SIZE(newEpilogue, 0);
-
-        // Create new block from remaining memory
-        size_t size = (size_t)(pageEnd - page);
-        block = create_block(epilogue, size);
+        // Create new block from the old epilogue and the new memory
+        block = create_block(epilogue, (size_t)(pageEnd - page));
 
         // If the previous block was free, coalesce with the new block
         if (!prevAlloc) {
-            block = coalesce_prev_block(block);
+            block = coalesce_prev_block(arena, block);
         } else {
             // Set previous block as allocated
             SET_PREV_ALLOC(block);
         }
-    } while (GET_SIZE(block) < block_size);
+    }
 
     // Split block if possible
     dy_block *split = split_block(block, block_size);
     if (split != NULL) {
         // Insert split block into free list
-        insert_block_free_list(split);
+        insert_block_free_list(arena, split);
     }
 
     // Allocate block
@@ -441,21 +1028,33 @@ int check_pointer(void* pp) {
         return -1;
     }
 
-    // Check if start of block is in heap
-    dy_block *block = pp - ROW_SIZE;
-    if ((void *)block < dy_mem_start() || (void *)block > dy_mem_end()) {
+    // Slab objects have no header, they are checked against their page instead
+    if (IS_SLAB_POINTER(pp)) {
+        return check_slab_pointer(pp);
+    }
+
+    // Check if start of block is in a heap, anything else has to be a large block
+    dy_block *block = pp - HEADER_SIZE;
+    int heap = dy_mem_heap_index(block);
+    if (heap < 0) {
+        return check_large_block(block);
+    }
+    if (heap == DY_SLAB_HEAP) {
+        return -1;
+    }
+    if ((void *)block > dy_mem_heap_end(heap)) {
         return -1;
     }
 
     // Check if block size is valid
     size_t size = GET_SIZE(block);
-    if (size < MIN_BLOCK_SIZE || size % 8 != 0) {
+    if (size < MIN_ALLOC_BLOCK_SIZE || size % 8 != 0) {
         return -1;
     }
 
-    // Check if end of block is in heap
+    // Check if end of block is in the same heap
     dy_footer *end = (dy_footer *)((void *)block + size);
-    if ((void *)end < dy_mem_start() || (void *)end > dy_mem_end()) {
+    if ((void *)end < dy_mem_heap_start(heap) || (void *)end > dy_mem_heap_end(heap)) {
         return -1;
     }
 
@@ -466,8 +1065,9 @@ int check_pointer(void* pp) {
     
     // Check alloc bit of previous block if prev_alloc is 0
     if (!GET_PREV_ALLOC(block)) {
-        dy_footer *prev = (dy_footer *)((void *)block - ROW_SIZE);
-        if ((size_t) *prev & 0x1) {
+        dy_footer *prev = (dy_footer *)((void *)block - FOOTER_SIZE);
+        // Another thread may have just allocated the previous block, in which case prev_alloc is now set
+        if (((size_t) *prev & 0x1) && !(__atomic_load_n(&block->header, __ATOMIC_ACQUIRE) & PREV_BLOCK_ALLOCATED)) {
             return -1;
         }
     }
@@ -488,15 +1088,27 @@ int free_to_quick_list(dy_block *block) {
         return -1;
     }
 
-    // Check if quick list is full, flush if so
-    if (dy_quick_lists[index].length == QUICK_LIST_MAX) {
-        flush_quick_list(index);
+    // Make sure this thread's quick lists are flushed when it exits
+    if (!dy_thread_counters.initialized) {
+        init_thread();
+    }
+
+    // Check if quick list is full, evict its oldest blocks if so (keeping the recently freed ones)
+    dy_quick_list *list = &dy_quick_lists[index];
+    if (list->length >= list->capacity) {
+        evict_quick_list(index, list->length - QUICK_LIST_KEEP(list->capacity));
+        list->stats.flushes++;
     }
 
     // Add block to quick list
-    block->body.links.next = dy_quick_lists[index].first;
-    dy_quick_lists[index].first = block;
-    dy_quick_lists[index].length++;
+    QUICK_NEXT(block) = list->first;
+    list->first = block;
+    list->length++;
+
+    // Adapt the capacity to how the blocks of this size are being reused
+    if (++list->stats.frees - list->window.frees >= QUICK_LIST_WINDOW) {
+        adapt_quick_list(index);
+    }
 
     // Set quick list bit
     SET_IN_QUICK_LIST(block);
@@ -505,24 +1117,201 @@ int free_to_quick_list(dy_block *block) {
     return 0;
 }
 
+// Give the interior pages of a large free block back to the memory backend
+static void release_free_block(dy_block *block) {
+    size_t size = GET_SIZE(block);
+    if (size < RELEASE_THRESHOLD) {
+        return;
+    }
+    // Keep the page holding the header, free list links and tree node, and the page holding the footer
+    uintptr_t start = ((uintptr_t)block + sizeof(dy_block) + sizeof(dy_tree_node) + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    uintptr_t end = (uintptr_t)GET_FOOTER_PTR(block) & ~(PAGE_SZ - 1);
+    if (end > start) {
+        dy_mem_release((void *)start, end - start);
+    }
+}
+
+// Check if an arena may have a free block of at least the given size
+static bool has_free_block(dy_arena *arena, size_t block_size) {
+    if (IN_TREE(arena, block_size)) {
+        return tree_find_best_fit(arena, block_size) != NULL;
+    }
+    return find_free_list(arena, calc_min_free_list_index(block_size)) >= 0;
+}
+
+// Find the link pointing to a block in the calling thread's quick lists, or NULL if it is not in one of them
+static dy_block **find_quick_list_link(dy_block *block) {
+    int index = calc_quick_list_index(GET_SIZE(block));
+    if (index == -1) {
+        return NULL;
+    }
+    dy_block **link = &dy_quick_lists[index].first;
+    while (*link != NULL && *link != block) {
+        link = &QUICK_NEXT(*link);
+    }
+    // If the block was not found, it is cached by another thread
+    return *link == NULL ? NULL : link;
+}
+
+/**
+ * Grow an allocated block in place (arena lock must be held).
+ * The block absorbs its successor if that is free or in the calling thread's quick lists, and
+ * the heap is grown if the block (or that successor) is the last block of the heap.
+ * @param arena The arena owning the block.
+ * @param block The block to grow.
+ * @param block_size The new size of the block.
+ * @return 0 if the block was grown, -1 if it could not be (the block is left unchanged).
+ */
+int grow_block(dy_arena *arena, dy_block *block, size_t block_size) {
+    size_t size = GET_SIZE(block);
+    dy_block *next = (void *)block + size;
+    void *epilogue = EPILOGUE(dy_mem_heap_end(arena->heap));
+
+    // Check if the successor can be absorbed
+    size_t nextSize = 0;
+    dy_block **quickLink = NULL;
+    if ((void *)next != epilogue) {
+        if (!GET_ALLOC(next)) {
+            nextSize = GET_SIZE(next);
+        } else if (GET_IN_QUICK_LIST(next) && (quickLink = find_quick_list_link(next)) != NULL) {
+            nextSize = GET_SIZE(next);
+        }
+    }
+
+    // Grow the heap if the block is still too small and nothing but the epilogue follows. If a free
+    // block elsewhere may fit, moving there is better than growing the heap and leaving it unused.
+    void *end = (void *)next + nextSize;
+    if (size + nextSize < block_size) {
+        if (end != epilogue || has_free_block(arena, block_size)) {
+            return -1;
+        }
+        if (extend_heap(arena, (block_size - size - nextSize + PAGE_SZ - 1) / PAGE_SZ) == NULL) {
+            return -1;
+        }
+        end = EPILOGUE(dy_mem_heap_end(arena->heap));
+    }
+
+    // Absorb the successor and any new memory
+    if (quickLink != NULL) {
+        int index = calc_quick_list_index(nextSize);
+        *quickLink = QUICK_NEXT(next);
+        dy_quick_lists[index].length--;
+        CLEAR_IN_QUICK_LIST(next);
+    } else if (nextSize != 0) {
+        remove_block_free_list(arena, next);
+    }
+    SET_SIZE(block, (size_t)(end - (void *)block));
+
+    // Give back what is not needed (coalescing it with a free block after the old successor)
+    dy_block *split = split_block(block, block_size);
+    if (split != NULL) {
+        free_to_free_list(arena, split);
+    } else {
+        alloc_block(block);
+    }
+    return 0;
+}
+
+/**
+ * Shrink an allocated block in place (arena lock must be held).
+ * A remainder too small to be a block of its own is merged into a free successor if there is one.
+ * @param arena The arena owning the block.
+ * @param block The block to shrink.
+ * @param block_size The new size of the block.
+ */
+void shrink_block(dy_arena *arena, dy_block *block, size_t block_size) {
+    dy_block *split = split_block(block, block_size);
+    if (split != NULL) {
+        free_to_free_list(arena, split);
+        return;
+    }
+
+    // Move the start of a free successor back over the remainder
+    size_t size = GET_SIZE(block);
+    dy_block *next = (void *)block + size;
+    if (GET_ALLOC(next) || size == block_size) {
+        return;
+    }
+    size_t nextSize = GET_SIZE(next);
+    remove_block_free_list(arena, next);
+    SET_SIZE(block, block_size);
+    dy_block *newNext = create_block((void *)block + block_size, size - block_size + nextSize);
+    SET_PREV_ALLOC(newNext);
+    insert_block_free_list(arena, newNext);
+}
+
 /**
- * Free a block to the free list.
+ * Free a block to the free list of its arena (arena lock must be held).
+ * @param arena The arena owning the block.
  * @param block The block to free.
  */
-void free_to_free_list(dy_block *block) {
+void free_to_free_list(dy_arena *arena, dy_block *block) {
+    // Coalescing can be deferred to a sweep over the heap, leaving the neighbours untouched
+    bool defer = arena->coalesce_batch != 0;
+
     // Check if block can be coalesced with previous block
-    if (!GET_PREV_ALLOC(block)) {
-        block = coalesce_prev_block(block);
+    if (!defer && !GET_PREV_ALLOC(block)) {
+        block = coalesce_prev_block(arena, block);
     }
 
     // Check if block can be coalesced with next block
-    if (!GET_ALLOC((dy_block *)((void *)block + GET_SIZE(block)))) {
-        block = coalesce_next_block(block);
+    if (!defer && !GET_ALLOC((dy_block *)((void *)block + GET_SIZE(block)))) {
+        block = coalesce_next_block(arena, block);
     }
 
     // Deallocate block
     dealloc_block(block);
     
     // Insert block into free list
-    insert_block_free_list(block);
+    insert_block_free_list(arena, block);
+
+    // Return the memory behind large free blocks
+    release_free_block(block);
+
+    // Coalesce the whole heap once enough frees have been deferred
+    bool grewTop = block == arena->top;
+    if (defer && ++arena->deferred_frees >= arena->coalesce_batch) {
+        coalesce_heap(arena);
+        grewTop = true;
+    }
+
+    // Give the end of the heap back once the top chunk has grown past the trim threshold, keeping the top
+    // pad so that a block repeatedly allocated and freed at the end of the heap doesn't shrink it every time.
+    // Frees that leave the top chunk alone don't trim it, so room left by the growth policy is kept.
+    if (grewTop && dy_config.trim_threshold != 0 && arena->top != NULL &&
+        GET_SIZE(arena->top) >= dy_config.trim_threshold + dy_config.top_pad) {
+        trim_heap(arena, dy_config.top_pad);
+    }
+}
+
+/**
+ * Coalesce every run of adjacent free blocks in the heap of an arena (arena lock must be held).
+ * With deferred coalescing, this sweep runs every coalesce_batch frees and whenever the free lists
+ * have no block for a request.
+ * @param arena The arena whose heap to sweep.
+ */
+void coalesce_heap(dy_arena *arena) {
+    TRACE(TRACE_COALESCE_SWEEP, arena->deferred_frees);
+    arena->deferred_frees = 0;
+
+    // The epilogue is allocated, so every run of free blocks ends before it
+    dy_block *epilogue = EPILOGUE(dy_mem_heap_end(arena->heap));
+    dy_block *block = FIRST_BLOCK(arena->base);
+    while (block != epilogue) {
+        dy_block *next = (void *)block + GET_SIZE(block);
+        if (GET_ALLOC(block) || GET_ALLOC(next)) {
+            block = next;
+            continue;
+        }
+
+        // Merge the run into its first block, then file it under its new size
+        remove_block_free_list(arena, block);
+        while (!GET_ALLOC(next)) {
+            block = coalesce_next_block(arena, block);
+            next = (void *)block + GET_SIZE(block);
+        }
+        insert_block_free_list(arena, block);
+        release_free_block(block);
+        block = next;
+    }
 }
\ No newline at end of file
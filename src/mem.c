@@ -1,28 +1,54 @@
+#ifndef DY_MEM_MMAP
+
+#define _POSIX_C_SOURCE 200112L
+
 #include "dyma.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
- * This file provides a simulated heap with a max size of around 4MB, 
+ * This file provides simulated heaps (the default backend) with a max size of around 4MB each,
  * without breaking any other calls to malloc and free (which would break the unit tests).
+ * Every arena gets its own heap (as do the slab pages), and all heaps are carved out of one large allocation
+ * so the heap containing any address can be found with a bit of arithmetic.
  */
 
-static void *mem_start = NULL;
-static void *mem_end = NULL;
+#define HEAP_PAGES 1024
+#define HEAP_SPAN (PAGE_SZ * HEAP_PAGES)
+
+static void *mem_base = NULL;
+static void *mem_ends[DY_MEM_HEAPS];
+static pthread_once_t mem_once = PTHREAD_ONCE_INIT;
+
+// Allocate the memory backing all of the heaps
+static void init_mem() {
+    // Heaps start on page boundaries, which the slab pages rely on
+    void *base = malloc(HEAP_SPAN * DY_MEM_HEAPS + PAGE_SZ);
+    if (base == NULL) {
+        return;
+    }
+    base = (void *)(((uintptr_t)base + PAGE_SZ - 1) & ~(uintptr_t)(PAGE_SZ - 1));
+    for (int i = 0; i < DY_MEM_HEAPS; i++) {
+        mem_ends[i] = base + HEAP_SPAN * i;
+    }
+    mem_base = base;
+}
 
 /**
  * @return The starting address of the simulated heap.
  */
 void *dy_mem_start() {
-    return mem_start;
+    return dy_mem_heap_start(0);
 }
 
 /**
  * @return The ending address of the simulated heap.
  */
 void *dy_mem_end() {
-    return mem_end;
+    return dy_mem_heap_end(0);
 }
 
 /**
@@ -32,24 +58,134 @@ void *dy_mem_end() {
  *         On error, NULL is returned.
  */
 void *dy_mem_grow() {
-    static int page_count = 0;
-    if (mem_start == NULL) {
-        // Allocate 1024 pages immediately
-        mem_start = malloc(PAGE_SZ * 1024);
-        if (mem_start == NULL) {
-            return NULL;
-        }
-        mem_end = mem_start;
+    return dy_mem_heap_grow(0, 1);
+}
+
+/**
+ * @param heap Index of the heap.
+ * @return The starting address of the simulated heap, or NULL if it does not exist yet.
+ */
+void *dy_mem_heap_start(int heap) {
+    if (mem_base == NULL) {
+        return NULL;
     }
+    return mem_base + HEAP_SPAN * heap;
+}
 
-    if (page_count >= 1024) {
-        // Maximum number of pages reached
+/**
+ * @param heap Index of the heap.
+ * @return The ending address of the simulated heap, or NULL if it does not exist yet.
+ */
+void *dy_mem_heap_end(int heap) {
+    if (mem_base == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&mem_ends[heap], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Utilized to increase the size of a simulated heap by a number of pages.
+ * Each heap must only be grown by one thread at a time.
+ *
+ * @param heap Index of the heap.
+ * @param pages Number of pages to add.
+ * @return On success, returns a pointer to the start of the first additional page.
+ *         On error, NULL is returned and the heap is left unchanged.
+ */
+void *dy_mem_heap_grow(int heap, size_t pages) {
+    pthread_once(&mem_once, init_mem);
+    if (mem_base == NULL) {
         return NULL;
     }
-    page_count++;
 
+    void *new_page = mem_ends[heap];
+    size_t left = (size_t)(mem_base + HEAP_SPAN * (heap + 1) - new_page) / PAGE_SZ;
+    if (pages > left) {
+        // Maximum number of pages reached
+        return NULL;
+    }
 
-    void *new_page = mem_end;
-    mem_end += PAGE_SZ;
+    __atomic_store_n(&mem_ends[heap], new_page + PAGE_SZ * pages, __ATOMIC_RELEASE);
     return new_page;
-}
\ No newline at end of file
+}
+
+/**
+ * Utilized to decrease the size of a simulated heap by a number of pages, from its end.
+ * Each heap must only be shrunk by the thread allowed to grow it.
+ *
+ * @param heap Index of the heap.
+ * @param pages Number of pages to remove, at most the size of the heap.
+ */
+void dy_mem_heap_shrink(int heap, size_t pages) {
+    __atomic_store_n(&mem_ends[heap], mem_ends[heap] - PAGE_SZ * pages, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find the simulated heap containing an address.
+ *
+ * @param ptr The address to look up.
+ * @return The index of the heap whose reserved range contains ptr, or -1 if there is none.
+ */
+int dy_mem_heap_index(void *ptr) {
+    if (mem_base == NULL || ptr < mem_base || ptr >= mem_base + HEAP_SPAN * DY_MEM_HEAPS) {
+        return -1;
+    }
+    return (ptr - mem_base) / HEAP_SPAN;
+}
+
+/**
+ * Give the memory behind a range of pages back to the OS.
+ * The simulated heaps are a single malloc'd block, so there is nothing to give back.
+ *
+ * @param ptr Start of the range, must be page aligned.
+ * @param size Size of the range in bytes, must be a multiple of the page size.
+ */
+void dy_mem_release(void *ptr, size_t size) {
+}
+
+/**
+ * Map a standalone region of memory, outside of the heaps.
+ * The simulated backend uses page-aligned allocations from the system allocator.
+ *
+ * @param size Size of the region in bytes, must be a multiple of the page size.
+ * @return On success, returns a pointer to the page-aligned region.
+ *         On error, NULL is returned.
+ */
+void *dy_mem_map(size_t size) {
+    void *ptr;
+    if (posix_memalign(&ptr, PAGE_SZ, size)) {
+        return NULL;
+    }
+    return ptr;
+}
+
+/**
+ * Resize a region returned by dy_mem_map, possibly moving it.
+ *
+ * @param ptr Start of the region.
+ * @param old_size Current size of the region in bytes.
+ * @param new_size New size of the region in bytes, must be a multiple of the page size.
+ * @return On success, returns a pointer to the resized region and the old pointer is no longer valid.
+ *         On error, NULL is returned and the region is left unchanged.
+ */
+void *dy_mem_remap(void *ptr, size_t old_size, size_t new_size) {
+    void *new_ptr = dy_mem_map(new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    free(ptr);
+    return new_ptr;
+}
+
+/**
+ * Unmap a region returned by dy_mem_map.
+ *
+ * @param ptr Start of the region.
+ * @param size Size of the region in bytes.
+ */
+void dy_mem_unmap(void *ptr, size_t size) {
+    free(ptr);
+}
+
+#endif
@@ -0,0 +1,217 @@
+#ifdef DY_MEM_MMAP
+
+#define _GNU_SOURCE
+
+#include "dyma.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/*
+ * This file provides heaps backed directly by the OS (build with MEM=mmap).
+ * A large range of address space is reserved up front for every heap, and pages are only
+ * committed (made readable and writable) as the heap grows into them. Like the simulated
+ * heaps, all heaps live in one reservation so the heap containing an address is found with
+ * a bit of arithmetic.
+ */
+
+// Address space reserved for each heap
+#ifndef DY_MMAP_HEAP_SIZE
+#define DY_MMAP_HEAP_SIZE ((size_t)1 << 30)
+#endif
+
+// Pages are committed in chunks of this many bytes to avoid a system call per page
+#define COMMIT_CHUNK (PAGE_SZ * 16)
+
+static void *mem_base = NULL;
+static void *mem_ends[DY_MEM_HEAPS];
+static void *mem_committed[DY_MEM_HEAPS];
+static pthread_once_t mem_once = PTHREAD_ONCE_INIT;
+
+// Reserve the address space for all of the heaps
+static void init_mem() {
+    void *base = mmap(NULL, DY_MMAP_HEAP_SIZE * DY_MEM_HEAPS, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return;
+    }
+    for (int i = 0; i < DY_MEM_HEAPS; i++) {
+        mem_ends[i] = base + DY_MMAP_HEAP_SIZE * i;
+        mem_committed[i] = mem_ends[i];
+    }
+    mem_base = base;
+}
+
+/**
+ * @return The starting address of the first heap.
+ */
+void *dy_mem_start() {
+    return dy_mem_heap_start(0);
+}
+
+/**
+ * @return The ending address of the first heap.
+ */
+void *dy_mem_end() {
+    return dy_mem_heap_end(0);
+}
+
+/**
+ * Utilized to increase the size of the first heap by one page.
+ *
+ * @return On success, returns a pointer to the start of the additional page.
+ *         On error, NULL is returned.
+ */
+void *dy_mem_grow() {
+    return dy_mem_heap_grow(0, 1);
+}
+
+/**
+ * @param heap Index of the heap.
+ * @return The starting address of the heap, or NULL if it does not exist yet.
+ */
+void *dy_mem_heap_start(int heap) {
+    if (mem_base == NULL) {
+        return NULL;
+    }
+    return mem_base + DY_MMAP_HEAP_SIZE * heap;
+}
+
+/**
+ * @param heap Index of the heap.
+ * @return The ending address of the heap, or NULL if it does not exist yet.
+ */
+void *dy_mem_heap_end(int heap) {
+    if (mem_base == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&mem_ends[heap], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Utilized to increase the size of a heap by a number of pages, committing more memory if needed.
+ * Each heap must only be grown by one thread at a time.
+ *
+ * @param heap Index of the heap.
+ * @param pages Number of pages to add.
+ * @return On success, returns a pointer to the start of the first additional page.
+ *         On error, NULL is returned and the heap is left unchanged.
+ */
+void *dy_mem_heap_grow(int heap, size_t pages) {
+    pthread_once(&mem_once, init_mem);
+    if (mem_base == NULL) {
+        return NULL;
+    }
+
+    void *new_page = mem_ends[heap];
+    void *limit = mem_base + DY_MMAP_HEAP_SIZE * (heap + 1);
+    if (pages > (size_t)(limit - new_page) / PAGE_SZ) {
+        // Reserved range exhausted
+        return NULL;
+    }
+    void *new_end = new_page + PAGE_SZ * pages;
+
+    // Commit whole chunks of the reservation up to the new end if they are not committed yet
+    if (new_end > mem_committed[heap]) {
+        void *commit_end = (void *)(((uintptr_t)new_end + COMMIT_CHUNK - 1) & ~(uintptr_t)(COMMIT_CHUNK - 1));
+        if (commit_end > limit) {
+            commit_end = limit;
+        }
+        if (mprotect(mem_committed[heap], commit_end - mem_committed[heap], PROT_READ | PROT_WRITE)) {
+            return NULL;
+        }
+        mem_committed[heap] = commit_end;
+    }
+
+    __atomic_store_n(&mem_ends[heap], new_end, __ATOMIC_RELEASE);
+    return new_page;
+}
+
+/**
+ * Utilized to decrease the size of a heap by a number of pages, from its end. The pages are given
+ * back to the OS, and whole chunks past the new end are decommitted.
+ * Each heap must only be shrunk by the thread allowed to grow it.
+ *
+ * @param heap Index of the heap.
+ * @param pages Number of pages to remove, at most the size of the heap.
+ */
+void dy_mem_heap_shrink(int heap, size_t pages) {
+    void *new_end = mem_ends[heap] - PAGE_SZ * pages;
+    __atomic_store_n(&mem_ends[heap], new_end, __ATOMIC_RELEASE);
+    madvise(new_end, PAGE_SZ * pages, MADV_DONTNEED);
+
+    void *commit_end = (void *)(((uintptr_t)new_end + COMMIT_CHUNK - 1) & ~(uintptr_t)(COMMIT_CHUNK - 1));
+    if (commit_end < mem_committed[heap] && mprotect(commit_end, mem_committed[heap] - commit_end, PROT_NONE) == 0) {
+        mem_committed[heap] = commit_end;
+    }
+}
+
+/**
+ * Find the heap containing an address.
+ *
+ * @param ptr The address to look up.
+ * @return The index of the heap whose reserved range contains ptr, or -1 if there is none.
+ */
+int dy_mem_heap_index(void *ptr) {
+    if (mem_base == NULL || ptr < mem_base || ptr >= mem_base + DY_MMAP_HEAP_SIZE * DY_MEM_HEAPS) {
+        return -1;
+    }
+    return (ptr - mem_base) / DY_MMAP_HEAP_SIZE;
+}
+
+/**
+ * Give the physical memory behind a range of pages back to the OS.
+ * The pages stay committed and read back as zeros the next time they are touched.
+ *
+ * @param ptr Start of the range, must be page aligned.
+ * @param size Size of the range in bytes, must be a multiple of the page size.
+ */
+void dy_mem_release(void *ptr, size_t size) {
+    madvise(ptr, size, MADV_DONTNEED);
+}
+
+/**
+ * Map a standalone region of memory, outside of the heaps.
+ *
+ * @param size Size of the region in bytes, must be a multiple of the page size.
+ * @return On success, returns a pointer to the page-aligned region.
+ *         On error, NULL is returned.
+ */
+void *dy_mem_map(size_t size) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    return ptr;
+}
+
+/**
+ * Resize a region returned by dy_mem_map, possibly moving it without copying.
+ *
+ * @param ptr Start of the region.
+ * @param old_size Current size of the region in bytes.
+ * @param new_size New size of the region in bytes, must be a multiple of the page size.
+ * @return On success, returns a pointer to the resized region and the old pointer is no longer valid.
+ *         On error, NULL is returned and the region is left unchanged.
+ */
+void *dy_mem_remap(void *ptr, size_t old_size, size_t new_size) {
+    void *new_ptr = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+    if (new_ptr == MAP_FAILED) {
+        return NULL;
+    }
+    return new_ptr;
+}
+
+/**
+ * Unmap a region returned by dy_mem_map.
+ *
+ * @param ptr Start of the region.
+ * @param size Size of the region in bytes.
+ */
+void dy_mem_unmap(void *ptr, size_t size) {
+    munmap(ptr, size);
+}
+
+#endif
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
+
 #include <criterion/criterion.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "dyma.h"
 #include "dyma_utils.h"
@@ -9,13 +14,17 @@
 void assert_free_block_count(size_t size, int count) {
     int cnt = 0;
     for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        dy_block *bp = dy_free_list_heads[i].body.links.next;
+        dy_block *bp = NEXT_FREE(get_thread_arena(), &dy_free_list_heads[i]);
         while (bp != &dy_free_list_heads[i]) {
             if (size == 0 || size == (bp->header & ~0x7))
                 cnt++;
-            bp = bp->body.links.next;
+            bp = NEXT_FREE(get_thread_arena(), bp);
         }
     }
+    // The top chunk is free too, outside of the free lists
+    dy_block *top = get_thread_arena()->top;
+    if (top != NULL && (size == 0 || size == GET_SIZE(top)))
+        cnt++;
     if (size == 0) {
         cr_assert_eq(cnt, count, "Wrong number of free blocks (exp=%d, found=%d)",
                      count, cnt);
@@ -25,17 +34,52 @@ void assert_free_block_count(size_t size, int count) {
     }
 }
 
+#ifdef DY_TLSF
+// Index of the classic (power of two) free list a block of the given size would be in
+int classic_free_list_index(size_t size) {
+    int index = 0;
+    for (size_t limit = MIN_BLOCK_SIZE; size > limit && index < 9; limit <<= 1) {
+        index++;
+    }
+    return index;
+}
+#endif
+
 void assert_free_list_size(int index, int size) {
     int cnt = 0;
-    dy_block *bp = dy_free_list_heads[index].body.links.next;
+#ifdef DY_TLSF
+    // Free lists are organized differently, count the blocks that would be in the classic free list
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        dy_block *bp = NEXT_FREE(get_thread_arena(), &dy_free_list_heads[i]);
+        while (bp != &dy_free_list_heads[i]) {
+            if (classic_free_list_index(bp->header & ~0x7) == index)
+                cnt++;
+            bp = NEXT_FREE(get_thread_arena(), bp);
+        }
+    }
+#else
+    dy_block *bp = NEXT_FREE(get_thread_arena(), &dy_free_list_heads[index]);
     while (bp != &dy_free_list_heads[index]) {
         cnt++;
-        bp = bp->body.links.next;
+        bp = NEXT_FREE(get_thread_arena(), bp);
     }
+#endif
     cr_assert_eq(cnt, size, "Free list %d has wrong number of free blocks (exp=%d, found=%d)",
                  index, size, cnt);
 }
 
+// Check if the bitmaps of an arena mark a free list as non-empty
+int free_list_marked(dy_arena *arena, int index) {
+#ifdef DY_TLSF
+    int fl = index / TLSF_SL_COUNT;
+    int flBit = (arena->free_list_bitmap >> fl) & 1;
+    cr_assert(flBit == (arena->sl_bitmaps[fl] != 0), "First level bitmap bit %d is %d", fl, flBit);
+    return (arena->sl_bitmaps[fl] >> (index % TLSF_SL_COUNT)) & 1;
+#else
+    return (arena->free_list_bitmap >> index) & 1;
+#endif
+}
+
 void assert_quick_list_block_count(size_t size, int count) {
     int cnt = 0;
     for (int i = 0; i < NUM_QUICK_LISTS; i++) {
@@ -43,7 +87,7 @@ void assert_quick_list_block_count(size_t size, int count) {
         while (bp != NULL) {
             if (size == 0 || size == (bp->header & ~0x7))
                 cnt++;
-            bp = bp->body.links.next;
+            bp = QUICK_NEXT(bp);
         }
     }
     if (size == 0) {
@@ -55,6 +99,8 @@ void assert_quick_list_block_count(size_t size, int count) {
     }
 }
 
+#ifndef DY_COMPACT
+// These tests check exact block sizes and offsets, which are smaller in compact heaps
 Test(dyma_suite, malloc_an_int, .timeout = TEST_TIMEOUT) {
     dy_errno = 0;
     size_t sz = sizeof(int);
@@ -68,8 +114,9 @@ Test(dyma_suite, malloc_an_int, .timeout = TEST_TIMEOUT) {
 
     assert_quick_list_block_count(0, 0);
     assert_free_block_count(0, 1);
-    assert_free_block_count(4024, 1);
-    assert_free_list_size(7, 1);
+    assert_free_block_count(4032, 1);
+    assert_free_list_size(7, 0);
+    cr_assert(GET_SIZE(get_thread_arena()->top) == 4032, "The rest of the heap is not the top chunk");
 
     cr_assert(dy_errno == 0, "dy_errno is not zero!");
     cr_assert(dy_mem_start() + PAGE_SZ == dy_mem_end(), "Allocated more than necessary!");
@@ -92,10 +139,58 @@ Test(dyma_suite, malloc_too_large, .timeout = TEST_TIMEOUT) {
     cr_assert_null(x, "x is not NULL!");
     assert_quick_list_block_count(0, 0);
     assert_free_block_count(0, 1);
-    assert_free_block_count(4194264, 1);
+    assert_free_block_count(4056, 1);
     cr_assert(dy_errno == ENOMEM, "dy_errno is not ENOMEM!");
+    cr_assert(dy_mem_start() + PAGE_SZ == dy_mem_end(), "Heap grew for a request that cannot be satisfied!");
 }
 
+Test(dyma_suite, malloc_grow_exact, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that a large allocation grows the heap by exactly the pages needed in one step.
+     */
+    dy_errno = 0;
+    size_t sz = 1 << 20;
+    void *x = dy_malloc(sz);
+    cr_assert_not_null(x, "x is NULL!");
+
+    // The first page holds 4056 bytes of free space, the rest comes from new pages
+    size_t pages = (calc_block_size(sz) - 4056 + PAGE_SZ - 1) / PAGE_SZ;
+    cr_assert(dy_mem_start() + PAGE_SZ * (pages + 1) == dy_mem_end(), "Heap did not grow by exactly %ld pages!", pages);
+    assert_free_block_count(0, 1);
+    assert_free_block_count(4056 + pages * PAGE_SZ - calc_block_size(sz), 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+#endif
+
+Test(dyma_suite, malloc_grow_policy, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test the growth increment and geometric growth policies.
+     */
+    cr_assert(dy_mallopt(DY_OPT_GROW_PAGES, 16) == 0, "dy_mallopt(DY_OPT_GROW_PAGES) failed");
+    void *x = dy_malloc(sizeof(int));
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(dy_mem_start() + PAGE_SZ * 16 == dy_mem_end(), "Heap did not start with 16 pages!");
+
+    // Use up the heap so that the next allocation has to grow it
+    void *y = dy_malloc(PAGE_SZ * 16 - ROW_SIZE);
+    cr_assert_not_null(y, "y is NULL!");
+    cr_assert(dy_mem_start() + PAGE_SZ * 32 == dy_mem_end(), "Heap did not grow by 16 pages!");
+
+    // Double the heap size once that exceeds the increment
+    cr_assert(dy_mallopt(DY_OPT_GROW_PERCENT, 100) == 0, "dy_mallopt(DY_OPT_GROW_PERCENT) failed");
+    void *z = dy_malloc(PAGE_SZ * 17);
+    cr_assert_not_null(z, "z is NULL!");
+    cr_assert(dy_mem_start() + PAGE_SZ * 64 == dy_mem_end(), "Heap did not double in size!");
+
+    // Invalid parameters
+    dy_errno = 0;
+    cr_assert(dy_mallopt(DY_OPT_GROW_PAGES, 0) == -1, "dy_mallopt(DY_OPT_GROW_PAGES, 0) succeeded");
+    cr_assert(dy_errno == EINVAL, "dy_errno != EINVAL");
+    cr_assert(dy_mallopt(-1, 0) == -1, "dy_mallopt(-1, 0) succeeded");
+}
+
+#ifndef DY_COMPACT
 Test(dyma_suite, free_quick, .timeout = TEST_TIMEOUT) {
     dy_errno = 0;
     size_t sz_x = 8, sz_y = 32, sz_z = 1;
@@ -108,7 +203,7 @@ Test(dyma_suite, free_quick, .timeout = TEST_TIMEOUT) {
     assert_quick_list_block_count(0, 1);
     assert_quick_list_block_count(40, 1);
     assert_free_block_count(0, 1);
-    assert_free_block_count(3952, 1);
+    assert_free_block_count(3968, 1);
     cr_assert(dy_errno == 0, "dy_errno is not zero!");
 }
 
@@ -124,7 +219,7 @@ Test(dyma_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
     assert_quick_list_block_count(0, 0);
     assert_free_block_count(0, 2);
     assert_free_block_count(208, 1);
-    assert_free_block_count(3784, 1);
+    assert_free_block_count(3800, 1);
 
     cr_assert(dy_errno == 0, "dy_errno is not zero!");
 }
@@ -143,11 +238,44 @@ Test(dyma_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
     assert_quick_list_block_count(0, 0);
     assert_free_block_count(0, 2);
     assert_free_block_count(520, 1);
-    assert_free_block_count(3472, 1);
+    assert_free_block_count(3488, 1);
 
     cr_assert(dy_errno == 0, "dy_errno is not zero!");
 }
 
+Test(dyma_suite, free_fragment, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that tiny blocks are packed without footers, and that a freed tiny block too small
+     * for the free lists goes to the fragment list until its neighbours are freed.
+     */
+    void *ptrs[12];
+    for (int i = 0; i < 12; i++) {
+        ptrs[i] = dy_malloc(16);
+        cr_assert_not_null(ptrs[i], "dy_malloc(16) failed");
+    }
+    cr_assert(ptrs[1] - ptrs[0] == MIN_ALLOC_BLOCK_SIZE, "Tiny blocks are not %d bytes apart", MIN_ALLOC_BLOCK_SIZE);
+
+    // Freeing every other block overflows the quick list, whose oldest blocks become fragments
+    for (int i = 0; i < 12; i += 2) {
+        dy_free(ptrs[i]);
+    }
+    dy_block *fragment = ptrs[0] - HEADER_SIZE;
+    cr_assert(!GET_ALLOC(fragment) && GET_SIZE(fragment) == MIN_ALLOC_BLOCK_SIZE, "Oldest block was not flushed");
+    cr_assert(get_thread_arena()->fragment_blocks > 0, "Fragment is not in the fragment list");
+    assert_free_block_count(0, 1);
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+
+    // Freeing the rest coalesces the fragments back into one free block
+    for (int i = 1; i < 12; i += 2) {
+        dy_free(ptrs[i]);
+    }
+    flush_quick_list(calc_quick_list_index(MIN_ALLOC_BLOCK_SIZE));
+    cr_assert_eq(get_thread_arena()->fragment_blocks, 0, "Fragments were not coalesced");
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_SZ - HEAP_OVERHEAD, 1);
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
 Test(dyma_suite, freelist, .timeout = TEST_TIMEOUT) {
     size_t sz_u = 200, sz_v = 300, sz_w = 200, sz_x = 500, sz_y = 200, sz_z = 700;
     void *u = dy_malloc(sz_u);
@@ -166,7 +294,8 @@ Test(dyma_suite, freelist, .timeout = TEST_TIMEOUT) {
     assert_free_block_count(208, 3);
     assert_free_block_count(1896, 1);
     assert_free_list_size(3, 3);
-    assert_free_list_size(6, 1);
+    assert_free_list_size(6, 0);
+    cr_assert(GET_SIZE(get_thread_arena()->top) == 1896, "The rest of the heap is not the top chunk");
 }
 
 Test(dyma_suite, realloc_larger_block, .timeout = TEST_TIMEOUT) {
@@ -181,9 +310,9 @@ Test(dyma_suite, realloc_larger_block, .timeout = TEST_TIMEOUT) {
     cr_assert((bp->header & ~0x7) == 88, "Realloc'ed block size not what was expected!");
 
     assert_quick_list_block_count(0, 1);
-    assert_quick_list_block_count(32, 1);
+    assert_quick_list_block_count(MIN_ALLOC_BLOCK_SIZE, 1);
     assert_free_block_count(0, 1);
-    assert_free_block_count(3904, 1);
+    assert_free_block_count(3920, 1);
 }
 
 Test(dyma_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOUT) {
@@ -194,13 +323,14 @@ Test(dyma_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOUT) {
     cr_assert_not_null(y, "y is NULL!");
     cr_assert(x == y, "Payload addresses are different!");
 
+    // The 16 byte remainder is too small to be a block, so it is merged into the free block after it
     dy_block *bp = (dy_block *)((char *)y - sizeof(dy_header));
     cr_assert(bp->header & THIS_BLOCK_ALLOCATED, "Allocated bit is not set!");
-    cr_assert((bp->header & ~0x7) == 88, "Realloc'ed block size not what was expected!");
+    cr_assert((bp->header & ~0x7) == 72, "Realloc'ed block size not what was expected!");
 
     assert_quick_list_block_count(0, 0);
     assert_free_block_count(0, 1);
-    assert_free_block_count(3968, 1);
+    assert_free_block_count(3984, 1);
 }
 
 Test(dyma_suite, realloc_smaller_block_free_block, .timeout = TEST_TIMEOUT) {
@@ -212,13 +342,87 @@ Test(dyma_suite, realloc_smaller_block_free_block, .timeout = TEST_TIMEOUT) {
 
     dy_block *bp = (dy_block *)((char *)y - sizeof(dy_header));
     cr_assert(bp->header & THIS_BLOCK_ALLOCATED, "Allocated bit is not set!");
-    cr_assert((bp->header & ~0x7) == 32, "Realloc'ed block size not what was expected!");
+    cr_assert((bp->header & ~0x7) == MIN_ALLOC_BLOCK_SIZE, "Realloc'ed block size not what was expected!");
+
+    assert_quick_list_block_count(0, 0);
+    assert_free_block_count(0, 1);
+    assert_free_block_count(4032, 1);
+}
+
+Test(dyma_suite, realloc_grow_into_free_block, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test growing a block in place by absorbing the free block after it.
+     */
+    char *x = dy_malloc(200);
+    void *y = dy_malloc(200);
+    void *z = dy_malloc(200);
+    for (int i = 0; i < 200; i++) {
+        x[i] = i;
+    }
+    dy_free(y);
+    assert_free_block_count(208, 1);
+
+    // The free block is only partly needed, the rest stays free
+    char *x1 = dy_realloc(x, 300);
+    cr_assert(x1 == x, "Realloc did not grow the block in place!");
+    dy_block *bp = (dy_block *)(x1 - sizeof(dy_header));
+    cr_assert((bp->header & ~0x7) == 312, "Realloc'ed block size not what was expected!");
+    assert_free_block_count(104, 1);
+    for (int i = 0; i < 200; i++) {
+        cr_assert(x1[i] == (char)i, "Data was not preserved at %d", i);
+    }
+
+    dy_free(x1);
+    dy_free(z);
+    assert_free_block_count(0, 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+#endif
+
+Test(dyma_suite, realloc_grow_into_quick_list_block, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test growing a block in place by absorbing a block cached in this thread's quick list.
+     */
+    void *x = dy_malloc(40);
+    void *y = dy_malloc(40);
+    void *z = dy_malloc(40);
+    dy_free(y);
+    assert_quick_list_block_count(48, 1);
 
+    void *x1 = dy_realloc(x, 80);
+    cr_assert(x1 == x, "Realloc did not grow the block in place!");
+    dy_block *bp = (dy_block *)(x1 - sizeof(dy_header));
+    cr_assert((bp->header & ~0x7) == 96, "Realloc'ed block size not what was expected!");
+    cr_assert(!(bp->header & IN_QUICK_LIST), "Quick list bit is set!");
     assert_quick_list_block_count(0, 0);
+
+    dy_free(x1);
+    dy_free(z);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, realloc_grow_heap_end, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test growing the last block of the heap in place, growing the heap itself.
+     */
+    void *x = dy_malloc(PAGE_SZ / 8);
+    void *y = dy_malloc(PAGE_SZ - HEAP_OVERHEAD - HEADER_SIZE - calc_block_size(PAGE_SZ / 8));
+    assert_free_block_count(0, 0);
+    dy_block *bp = (dy_block *)((char *)y - HEADER_SIZE);
+    cr_assert((char *)bp + GET_SIZE(bp) == (char *)dy_mem_end() - HEADER_SIZE, "y is not the last block of the heap");
+
+    void *y1 = dy_realloc(y, 3 * PAGE_SZ);
+    cr_assert(y1 == y, "Realloc did not grow the block in place!");
+    cr_assert(dy_mem_end() - dy_mem_start() == (long)(4 * PAGE_SZ), "Heap did not grow by exactly the pages needed!");
+
+    dy_free(x);
+    dy_free(y1);
     assert_free_block_count(0, 1);
-    assert_free_block_count(4024, 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
 }
 
+#ifndef DY_TLSF
 Test(dyma_suite, calc_min_free_list, .timeout = TEST_TIMEOUT) {
     /**
      * Testing "calc_min_free_list_index" helper to ensure it returns the correct min
@@ -266,7 +470,37 @@ Test(dyma_suite, calc_min_free_list, .timeout = TEST_TIMEOUT) {
     // Test 20: size = 1024M
     cr_assert(calc_min_free_list_index(1024 * M) == 9, "calc_min_index(1024 * M) != 19");
 }
+#else
+Test(dyma_suite, calc_tlsf_free_list, .timeout = TEST_TIMEOUT) {
+    /**
+     * Testing the TLSF "calc_free_list_index" and "calc_min_free_list_index" helpers.
+     */
+    int M = MIN_BLOCK_SIZE;
+    // Small sizes get one second level per MIN_BLOCK_SIZE
+    cr_assert(calc_free_list_index(M) == 1, "calc_index(M) != 1");
+    cr_assert(calc_free_list_index(2 * M - ROW_SIZE) == 1, "calc_index(2M - 8) != 1");
+    cr_assert(calc_min_free_list_index(M) == 1, "calc_min_index(M) != 1");
+    cr_assert(calc_min_free_list_index(M + ROW_SIZE) == 2, "calc_min_index(M + 8) != 2");
+    // 8M (256) starts the first level 1, split into ranges of M
+    int L = TLSF_SL_COUNT * M;
+    cr_assert(calc_free_list_index(L) == TLSF_SL_COUNT, "calc_index(8M) != %d", TLSF_SL_COUNT);
+    cr_assert(calc_free_list_index(L + M) == TLSF_SL_COUNT + 1, "calc_index(9M) != %d", TLSF_SL_COUNT + 1);
+    cr_assert(calc_min_free_list_index(L + ROW_SIZE) == TLSF_SL_COUNT + 1, "calc_min_index(8M + 8) != %d",
+              TLSF_SL_COUNT + 1);
+    // Sizes beyond the last first level share the last free list
+    cr_assert(calc_free_list_index((size_t)1 << 40) == NUM_FREE_LISTS - 1, "calc_index(2^40) != last");
+
+    // Every block inserted at or after the search index is large enough
+    for (size_t size = M; size < (1 << 20); size += ROW_SIZE) {
+        int index = calc_min_free_list_index(size);
+        cr_assert(calc_free_list_index(size) <= index, "Size %ld is inserted after its search index", size);
+        cr_assert(calc_free_list_index(size - ROW_SIZE) < index || size == (size_t)M,
+                  "Size %ld is found by a search for %ld", size - ROW_SIZE, size);
+    }
+}
+#endif
 
+#ifndef DY_COMPACT
 Test(dyma_suite, calc_block_size, .timeout = TEST_TIMEOUT) {
     /**
      * Testing "calc_block_size" helper to ensure it returns the correct
@@ -274,24 +508,28 @@ Test(dyma_suite, calc_block_size, .timeout = TEST_TIMEOUT) {
      */
 
     // Test 1: size = 1
-    cr_assert(calc_block_size(1) == 32, "calc_block_size(1) != 32");
-    // Test 2: size = 24
+    cr_assert(calc_block_size(1) == 24, "calc_block_size(1) != 24");
+    // Test 2: size = 16
+    cr_assert(calc_block_size(16) == 24, "calc_block_size(16) != 24");
+    // Test 3: size = 17
+    cr_assert(calc_block_size(17) == 32, "calc_block_size(17) != 32");
+    // Test 4: size = 24
     cr_assert(calc_block_size(24) == 32, "calc_block_size(24) != 32");
-    // Test 3: size = 25
+    // Test 5: size = 25
     cr_assert(calc_block_size(25) == 40, "calc_block_size(25) != 40");
-    // Test 4: size = 48
+    // Test 6: size = 48
     cr_assert(calc_block_size(48) == 56, "calc_block_size(48) != 56");
-    // Test 5: size = 49
+    // Test 7: size = 49
     cr_assert(calc_block_size(49) == 64, "calc_block_size(49) != 64");
-    // Test 6: size = 56
+    // Test 8: size = 56
     cr_assert(calc_block_size(56) == 64, "calc_block_size(56) != 64");
-    // Test 7: size = 57
+    // Test 9: size = 57
     cr_assert(calc_block_size(57) == 72, "calc_block_size(57) != 72");
-    // Test 8: size = 100
+    // Test 10: size = 100
     cr_assert(calc_block_size(100) == 112, "calc_block_size(100) != 112");
-    // Test 9: size = 1000
+    // Test 11: size = 1000
     cr_assert(calc_block_size(1000) == 1008, "calc_block_size(1000) != 1008");
-    // Test 10: size = 10000
+    // Test 12: size = 10000
     cr_assert(calc_block_size(10000) == 10008, "calc_block_size(10000) != 10008");
 }
 
@@ -300,16 +538,67 @@ Test(dyma_suite, calc_quick_list, .timeout = TEST_TIMEOUT) {
      * Testing "calc_quick_list_index" helper to ensure it returns the quick list
      * index for a given payload size.
      */
-    // Test index 0 - 19
-    for (int i = 0; i < 20; i++) {
-        int size = 32 + i * 8;
+    // Test index 0 - 20
+    for (int i = 0; i < 21; i++) {
+        int size = 24 + i * 8;
         cr_assert(calc_quick_list_index(size) == i, "calc_quick_list_index(%d) != %d", size, i);
     }
 
     // Test too large
-    int size = 32 * 20 + 8;
+    int size = 24 + 21 * 8;
     cr_assert(calc_quick_list_index(size) == -1, "calc_quick_list_index(%d) != -1", size);
 }
+#else
+Test(dyma_suite, calc_compact_block_size, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that compact blocks only add a 4 byte header, down to 16 byte blocks.
+     */
+    cr_assert(calc_block_size(1) == 16, "calc_block_size(1) != 16");
+    cr_assert(calc_block_size(12) == 16, "calc_block_size(12) != 16");
+    cr_assert(calc_block_size(13) == 24, "calc_block_size(13) != 24");
+    cr_assert(calc_block_size(20) == 24, "calc_block_size(20) != 24");
+    cr_assert(calc_block_size(21) == 32, "calc_block_size(21) != 32");
+    cr_assert(calc_block_size(1000) == 1008, "calc_block_size(1000) != 1008");
+    cr_assert(calc_block_size(1004) == 1008, "calc_block_size(1004) != 1008");
+
+    // Quick lists start at the smallest block
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        int size = 16 + i * 8;
+        cr_assert(calc_quick_list_index(size) == i, "calc_quick_list_index(%d) != %d", size, i);
+    }
+    cr_assert(calc_quick_list_index(16 + NUM_QUICK_LISTS * 8) == -1, "calc_quick_list_index too large != -1");
+}
+
+Test(dyma_suite, compact_layout, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that small blocks are packed at 4 byte header granularity with aligned payloads,
+     * and that free blocks are linked by offsets from the start of the heap.
+     */
+    void *ptrs[8];
+    for (int i = 0; i < 8; i++) {
+        ptrs[i] = dy_malloc(20);
+        cr_assert_not_null(ptrs[i], "dy_malloc(20) failed");
+        cr_assert((uintptr_t)ptrs[i] % ROW_SIZE == 0, "Payload %d is not aligned", i);
+        cr_assert(GET_SIZE((dy_block *)(ptrs[i] - HEADER_SIZE)) == 24, "Block %d is not 24 bytes", i);
+    }
+    cr_assert(ptrs[1] - ptrs[0] == 24, "20 byte blocks are not 24 bytes apart");
+    cr_assert(FIRST_BLOCK(dy_mem_start())->body.payload == ptrs[0], "First block does not follow the prologue");
+
+    // A free block between allocated ones is linked to its list head inside the prologue
+    dy_arena *arena = get_thread_arena();
+    flush_quick_list(calc_quick_list_index(24));
+    dy_free(ptrs[2]);
+    flush_quick_list(calc_quick_list_index(24));
+    dy_block *block = ptrs[2] - HEADER_SIZE;
+    cr_assert(!GET_ALLOC(block), "Block was not freed to the free lists");
+    dy_block *head = &arena->free_list_heads[calc_free_list_index(24)];
+    cr_assert((void *)head > dy_mem_start() && (void *)head < (void *)FIRST_BLOCK(dy_mem_start()),
+              "Free list head is not in the prologue");
+    cr_assert(block->body.links.next == (dy_link)((void *)head - dy_mem_start()), "Block is not linked by offset");
+    cr_assert(NEXT_FREE(arena, head) == block, "Free list head does not link to the block");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+#endif
 
 Test(dyma_suite, malloc_size_zero, .timeout = TEST_TIMEOUT) {
     /**
@@ -356,19 +645,19 @@ Test(dyma_suite, flush_quicklist, .timeout = TEST_TIMEOUT) {
 	assert_quick_list_block_count(32, QUICK_LIST_MAX);
 	assert_free_block_count(0, 1);
 
-	// Flush the quick list by freeing the last block
+	// Flush the oldest blocks of the quick list by freeing the last block
 	dy_free(ptrs[QUICK_LIST_MAX]);
 
-	// Quick list for 32 should contain 1 block, free list should have 2 blocks (fragmented by the one element in the quick list so sad)
-	assert_quick_list_block_count(32, 1);
+	// The oldest blocks are merged into one free block (fragmented from the rest of the heap by the blocks still in the quick list so sad)
+	assert_quick_list_block_count(32, QUICK_LIST_KEEP(QUICK_LIST_MAX) + 1);
 	assert_free_block_count(0, 2);
 
 	// Get a block from the quick list
 	void *ptr = dy_malloc(size);
 	cr_assert(ptr != NULL, "dy_malloc(%d) == NULL", size);
 
-	// Quick list for 32 should empty, free list should have 2 blocks
-	assert_quick_list_block_count(32, 0);
+	// Quick list for 32 should have one block less, free list should have 2 blocks
+	assert_quick_list_block_count(32, QUICK_LIST_KEEP(QUICK_LIST_MAX));
 	assert_free_block_count(0, 2);
 }
 
@@ -386,10 +675,10 @@ Test(dyma_suite, check_invalid_pointer, .timeout = TEST_TIMEOUT) {
 	valid = check_pointer(ptr + 1);
 	cr_assert(valid == -1, "check_pointer(ptr + 1) != -1");
 
-	// Test 3: Free a pointer that has a block size less than 32
-	dy_block *block = ptr - ROW_SIZE;
+	// Test 3: Free a pointer that has a block size less than the minimum
+	dy_block *block = ptr - HEADER_SIZE;
 	size_t orig = GET_SIZE(block);
-	SET_SIZE(block, 16);
+	SET_SIZE(block, MIN_ALLOC_BLOCK_SIZE - ROW_SIZE);
 	valid = check_pointer(ptr);
 	cr_assert(valid == -1, "check_pointer(ptr) != -1");
 
@@ -414,7 +703,7 @@ Test(dyma_suite, check_invalid_pointer, .timeout = TEST_TIMEOUT) {
     ptr2 = dy_malloc(sizeof(int) * 32);
     dy_free(ptr);
     // Set the previous block to allocated
-    size_t *footer = (void *)ptr2 - 2 * ROW_SIZE;
+    dy_footer *footer = (void *)ptr2 - HEADER_SIZE - FOOTER_SIZE;
     *footer = *(footer) | THIS_BLOCK_ALLOCATED;
     // Check that the pointer is invalid
     valid = check_pointer(ptr2);
@@ -426,7 +715,7 @@ Test(dyma_suite, malloc_gt_page, .timeout = TEST_TIMEOUT) {
 	 * Test allocating more than a page.
 	 */
 	dy_errno = 0;
-	size_t size_x = PAGE_SZ - MIN_BLOCK_SIZE - 2 * ROW_SIZE;
+	size_t size_x = PAGE_SZ - HEAP_OVERHEAD - HEADER_SIZE;
 
 	// Allocate the entire first page
 	void *ptr = dy_malloc(size_x);
@@ -453,7 +742,7 @@ Test(dyma_suite, malloc_gt_page2, .timeout = TEST_TIMEOUT) {
 	 * Test allocating more than a page, similar to test 8 but with slightly different order.
 	 */
 	dy_errno = 0;
-	size_t size_x = PAGE_SZ - MIN_BLOCK_SIZE - 2 * ROW_SIZE;
+	size_t size_x = PAGE_SZ - HEAP_OVERHEAD - HEADER_SIZE;
 
 	// Allocate the entire first page
 	void *ptr = dy_malloc(size_x);
@@ -582,12 +871,13 @@ Test(dyma_suite, coalescing_flushed, .timeout = TEST_TIMEOUT) {
     assert_free_block_count(0, 2);
     assert_quick_list_block_count(64 + 8, QUICK_LIST_MAX);
 
-    // Free the last block, causing quick list to be flushed
+    // Free the last block, causing the oldest blocks of the quick list to be flushed
     dy_free(ptrs[QUICK_LIST_MAX]);
     assert_free_block_count(0, 2);
-    assert_quick_list_block_count(64 + 8, 1);
+    assert_quick_list_block_count(64 + 8, QUICK_LIST_KEEP(QUICK_LIST_MAX) + 1);
 }
 
+#ifndef DY_COMPACT
 Test(dyma_suite, malloc_some_to_small, .timeout = TEST_TIMEOUT) {
     /**
      * Test searching for a free block in a free list which contains some blocks which are too small.
@@ -622,12 +912,13 @@ Test(dyma_suite, malloc_some_to_small, .timeout = TEST_TIMEOUT) {
     assert_free_block_count(0, 3);
     assert_free_list_size(5, 2);
 
-    // Try to allocate another block of size 960 (will pull from next free list)
+    // Try to allocate another block of size 960 (nothing else fits, so it is carved from the top chunk)
     void *p8 = dy_malloc(sz_z);
     cr_assert(p8 != NULL, "dy_malloc(%d) == NULL", sz_z);
     assert_free_block_count(0, 3);
     assert_free_list_size(5, 2);
-    assert_free_list_size(4, 1);
+    assert_free_list_size(4, 0);
+    cr_assert(p8 == (void *)p6 + calc_block_size(sz_y), "Block was not carved from the top chunk");
 
     // Free the remaining blocks
     dy_free(p2);
@@ -638,6 +929,7 @@ Test(dyma_suite, malloc_some_to_small, .timeout = TEST_TIMEOUT) {
     assert_free_block_count(0, 4);
     assert_quick_list_block_count(sz_y + 8, 3);
 }
+#endif
 
 Test(dyma_suite, memalign_enomem, .timeout = TEST_TIMEOUT) {
     /**
@@ -670,3 +962,1286 @@ Test(dyma_suite, free_invalid_pointer, .timeout = TEST_TIMEOUT, .signal = SIGABR
      */
     dy_free(NULL);
 }
+
+#define NUM_TEST_THREADS 8
+#define BLOCKS_PER_THREAD 64
+
+static void *thread_blocks[NUM_TEST_THREADS][BLOCKS_PER_THREAD];
+static size_t thread_sizes[NUM_TEST_THREADS][BLOCKS_PER_THREAD];
+
+static void *thread_stress_allocate(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned int seed = id + 1;
+    // Churn through private allocations, checking that no other thread scribbles on them
+    for (int round = 0; round < 200; round++) {
+        void *ptrs[16];
+        size_t sizes[16];
+        for (int i = 0; i < 16; i++) {
+            seed = seed * 1103515245 + 12345;
+            sizes[i] = 1 + (seed >> 16) % 256;
+            ptrs[i] = dy_malloc(sizes[i]);
+            if (ptrs[i] == NULL) {
+                return (void *)1;
+            }
+            memset(ptrs[i], id, sizes[i]);
+        }
+        for (int i = 0; i < 16; i++) {
+            for (size_t j = 0; j < sizes[i]; j++) {
+                if (((unsigned char *)ptrs[i])[j] != id) {
+                    return (void *)1;
+                }
+            }
+            dy_free(ptrs[i]);
+        }
+    }
+    // Leave some blocks behind to be freed by another thread
+    for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+        seed = seed * 1103515245 + 12345;
+        thread_sizes[id][i] = 1 + (seed >> 16) % 512;
+        thread_blocks[id][i] = dy_malloc(thread_sizes[id][i]);
+        if (thread_blocks[id][i] == NULL) {
+            return (void *)1;
+        }
+        memset(thread_blocks[id][i], id, thread_sizes[id][i]);
+    }
+    return NULL;
+}
+
+static void *thread_stress_free(void *arg) {
+    // Free the blocks left behind by the neighbouring thread
+    int owner = ((int)(intptr_t)arg + 1) % NUM_TEST_THREADS;
+    for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+        for (size_t j = 0; j < thread_sizes[owner][i]; j++) {
+            if (((unsigned char *)thread_blocks[owner][i])[j] != owner) {
+                return (void *)1;
+            }
+        }
+        dy_free(thread_blocks[owner][i]);
+    }
+    return NULL;
+}
+
+Test(dyma_suite, multithreaded_stress, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test concurrent allocations from several threads, including frees from a thread other than the allocator.
+     */
+    dy_errno = 0;
+    pthread_t threads[NUM_TEST_THREADS];
+    void *result;
+
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        cr_assert(pthread_create(&threads[i], NULL, thread_stress_allocate, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        cr_assert(result == NULL, "Thread %d saw a failed or corrupted allocation", i);
+    }
+
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        cr_assert(pthread_create(&threads[i], NULL, thread_stress_free, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        cr_assert(result == NULL, "Thread %d saw a corrupted allocation", i);
+    }
+
+    // Every thread has exited and flushed its quick lists, so each heap should be a single top chunk again
+    assert_quick_list_block_count(0, 0);
+    for (int i = 0; i < DY_NUM_ARENAS; i++) {
+        if (!dy_arenas[i].initialized) {
+            continue;
+        }
+        int cnt = 0;
+        for (int j = 0; j < NUM_FREE_LISTS; j++) {
+            dy_block *head = &dy_arenas[i].free_list_heads[j];
+            for (dy_block *bp = NEXT_FREE(&dy_arenas[i], head); bp != head; bp = NEXT_FREE(&dy_arenas[i], bp)) {
+                cnt++;
+            }
+        }
+        cr_assert_eq(cnt, 0, "Arena %d has wrong number of free blocks (exp=0, found=%d)", i, cnt);
+        cr_assert(dy_arenas[i].top == FIRST_BLOCK(dy_arenas[i].base), "Arena %d is not a single top chunk", i);
+    }
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+static void *thread_get_arena(void *arg) {
+    return get_thread_arena();
+}
+
+Test(dyma_suite, arena_per_thread, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that a new thread is served from a different arena than the main thread.
+     */
+    void *x = dy_malloc(sizeof(int));
+    cr_assert_not_null(x, "x is NULL!");
+
+    pthread_t thread;
+    void *y;
+    cr_assert(pthread_create(&thread, NULL, thread_get_arena, NULL) == 0);
+    pthread_join(thread, &y);
+
+    cr_assert(get_thread_arena() == &dy_arenas[0], "Main thread is not using the first arena!");
+    cr_assert(y != &dy_arenas[0], "Second thread is using the same arena as the main thread!");
+    cr_assert(get_block_arena((dy_block *)((char *)x - sizeof(dy_header))) == &dy_arenas[0],
+              "Block was not allocated from the main thread's arena!");
+}
+
+Test(dyma_suite, malloc_large_block, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that requests above the mmap threshold bypass the heap.
+     */
+    dy_errno = 0;
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 1 << 16) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+    void *x = dy_malloc(sizeof(int));
+    cr_assert_not_null(x, "x is NULL!");
+
+    // Larger than the whole simulated heap
+    size_t sz = PAGE_SZ * 2048;
+    char *y = dy_malloc(sz);
+    cr_assert_not_null(y, "y is NULL!");
+    cr_assert(dy_mem_heap_index(y) == -1, "Large block was allocated from a heap!");
+    cr_assert(check_pointer(y) == 0, "check_pointer rejected a large block");
+    cr_assert(check_pointer(y + 8) == -1, "check_pointer accepted a pointer inside a large block");
+    memset(y, 0xab, sz);
+
+    // The heap is untouched
+    cr_assert(dy_mem_start() + PAGE_SZ == dy_mem_end(), "Heap grew for a large block!");
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_SZ - HEAP_OVERHEAD - calc_block_size(sizeof(int)), 1);
+
+    dy_free(y);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, check_unmapped_pointer, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that pointers outside of the heaps are not dereferenced unless they are large blocks.
+     */
+    // A pointer at the start of a mapping, with nothing mapped before it
+    char *map = mmap(NULL, PAGE_SZ * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    cr_assert(map != MAP_FAILED, "mmap failed");
+    cr_assert(munmap(map, PAGE_SZ) == 0, "munmap failed");
+    void *pp = map + PAGE_SZ + 16;
+
+    // With the large path disabled
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 0) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+    cr_assert(check_pointer(pp) == -1, "check_pointer accepted an unmapped prefix");
+
+    // With a large block outstanding
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 1 << 16) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+    void *x = dy_malloc(1 << 20);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(check_pointer(pp) == -1, "check_pointer accepted an unmapped prefix");
+    cr_assert(check_pointer(x) == 0, "check_pointer rejected a large block");
+    dy_free(x);
+    cr_assert(check_pointer(x) == -1, "check_pointer accepted a freed large block");
+    munmap(map + PAGE_SZ, PAGE_SZ);
+}
+
+Test(dyma_suite, realloc_large_block, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test growing and shrinking large blocks with dy_realloc.
+     */
+    dy_errno = 0;
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 1 << 16) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+
+    // Grow a heap block past the threshold
+    unsigned char *x = dy_malloc(1000);
+    cr_assert_not_null(x, "x is NULL!");
+    for (int i = 0; i < 1000; i++) {
+        x[i] = i % 251;
+    }
+    x = dy_realloc(x, 1 << 20);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(dy_mem_heap_index(x) == -1, "Block did not become a large block!");
+    for (int i = 0; i < 1000; i++) {
+        cr_assert(x[i] == i % 251, "Data was not preserved at %d", i);
+    }
+    memset(x + 1000, 0xcd, (1 << 20) - 1000);
+
+    // Grow the large block
+    x = dy_realloc(x, 1 << 23);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(check_pointer(x) == 0, "check_pointer rejected a resized large block");
+    for (int i = 0; i < 1000; i++) {
+        cr_assert(x[i] == i % 251, "Data was not preserved at %d", i);
+    }
+    cr_assert(x[(1 << 20) - 1] == 0xcd, "Data was not preserved at the end of the block");
+
+    // Shrink it below the threshold, moving it back into the heap
+    x = dy_realloc(x, 500);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(dy_mem_heap_index(x) == 0, "Block did not move back into the heap!");
+    for (int i = 0; i < 500; i++) {
+        cr_assert(x[i] == i % 251, "Data was not preserved at %d", i);
+    }
+    dy_free(x);
+    assert_free_block_count(0, 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, memalign_large_block, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test allocating an aligned large block.
+     */
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 1 << 16) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+    size_t align = 1 << 16;
+    void *x = dy_memalign(1 << 20, align);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert((uintptr_t)x % align == 0, "x is not aligned");
+    cr_assert(dy_mem_heap_index(x) == -1, "Aligned block was allocated from a heap!");
+    memset(x, 0, 1 << 20);
+
+    // Aligned large blocks are moved rather than remapped
+    void *y = dy_realloc(x, 1 << 21);
+    cr_assert_not_null(y, "y is NULL!");
+    dy_free(y);
+}
+
+Test(dyma_suite, free_list_bitmap, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that the bitmap of non-empty free lists is kept in sync with the free lists.
+     */
+    size_t sizes[] = {200, 24, 400, 24, 900, 24, 1800, 24, 3000, 24};
+    void *ptrs[10];
+    for (int i = 0; i < 10; i++) {
+        ptrs[i] = dy_malloc(sizes[i]);
+        cr_assert_not_null(ptrs[i], "ptrs[%d] is NULL!", i);
+    }
+    // Free the larger blocks, leaving the small ones in between so they do not coalesce
+    for (int i = 0; i < 10; i += 2) {
+        dy_free(ptrs[i]);
+    }
+
+    dy_arena *arena = get_thread_arena();
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        int empty = NEXT_FREE(arena, &dy_free_list_heads[i]) == &dy_free_list_heads[i];
+        int bit = free_list_marked(arena, i);
+        cr_assert(bit == !empty, "Bitmap bit %d is %d but free list %d is %s", i, bit, i,
+                  empty ? "empty" : "not empty");
+    }
+
+    // Reallocate the freed blocks, emptying their free lists again
+    for (int i = 0; i < 10; i += 2) {
+        ptrs[i] = dy_malloc(sizes[i]);
+        cr_assert_not_null(ptrs[i], "ptrs[%d] is NULL!", i);
+    }
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        int empty = NEXT_FREE(arena, &dy_free_list_heads[i]) == &dy_free_list_heads[i];
+        int bit = free_list_marked(arena, i);
+        cr_assert(bit == !empty, "Bitmap bit %d is %d but free list %d is %s", i, bit, i,
+                  empty ? "empty" : "not empty");
+    }
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+// Check the red-black properties of a best fit subtree, returning its black height
+int check_tree(dy_block *node, dy_block *parent, int *count) {
+    if (node == NULL) {
+        return 1;
+    }
+    dy_tree_node *tn = TREE_NODE(node);
+    cr_assert(tn->parent == parent, "Tree node %p has the wrong parent", node);
+    cr_assert(!GET_ALLOC(node), "Tree node %p is allocated", node);
+    if (tn->red) {
+        cr_assert(tn->left == NULL || !TREE_NODE(tn->left)->red, "Red node %p has a red child", node);
+        cr_assert(tn->right == NULL || !TREE_NODE(tn->right)->red, "Red node %p has a red child", node);
+    }
+    if (tn->left != NULL) {
+        cr_assert(GET_SIZE(tn->left) < GET_SIZE(node) || (GET_SIZE(tn->left) == GET_SIZE(node) && tn->left < node),
+                  "Tree is out of order at %p", node);
+    }
+    if (tn->right != NULL) {
+        cr_assert(GET_SIZE(tn->right) > GET_SIZE(node) || (GET_SIZE(tn->right) == GET_SIZE(node) && tn->right > node),
+                  "Tree is out of order at %p", node);
+    }
+    (*count)++;
+    int left = check_tree(tn->left, node, count);
+    int right = check_tree(tn->right, node, count);
+    cr_assert(left == right, "Black heights differ at %p (%d != %d)", node, left, right);
+    return left + !tn->red;
+}
+
+// Check that the best fit tree of the calling thread's arena indexes exactly the large free blocks
+void assert_tree_valid() {
+    dy_arena *arena = get_thread_arena();
+    cr_assert(arena->tree_root == NULL || !TREE_NODE(arena->tree_root)->red, "Tree root is red");
+    int count = 0;
+    check_tree(arena->tree_root, NULL, &count);
+    int expected = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        dy_block *bp = NEXT_FREE(arena, &dy_free_list_heads[i]);
+        while (bp != &dy_free_list_heads[i]) {
+            if (IN_TREE(arena, GET_SIZE(bp)))
+                expected++;
+            bp = NEXT_FREE(arena, bp);
+        }
+    }
+    cr_assert_eq(count, expected, "Tree has wrong number of blocks (exp=%d, found=%d)", expected, count);
+}
+
+Test(dyma_suite, malloc_best_fit, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that large blocks are allocated from the smallest free block that fits, rather than the first.
+     */
+    size_t sizes[] = {3000, 1500, 2000, 1200};
+    void *ptrs[4];
+    void *guards[4];
+    for (int i = 0; i < 4; i++) {
+        ptrs[i] = dy_malloc(sizes[i]);
+        guards[i] = dy_malloc(32);
+        cr_assert(ptrs[i] != NULL && guards[i] != NULL, "dy_malloc failed");
+    }
+    for (int i = 0; i < 4; i++) {
+        dy_free(ptrs[i]);
+    }
+    assert_tree_valid();
+
+    // 1400 bytes fit best in the block that held 1500 bytes, 1100 in the one that held 1200
+    void *x = dy_malloc(1400);
+    cr_assert(x == ptrs[1], "dy_malloc(1400) did not reuse the best fitting block");
+    void *y = dy_malloc(1100);
+    cr_assert(y == ptrs[3], "dy_malloc(1100) did not reuse the best fitting block");
+    assert_tree_valid();
+
+    dy_free(x);
+    dy_free(y);
+    for (int i = 0; i < 4; i++) {
+        dy_free(guards[i]);
+    }
+    assert_tree_valid();
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, best_fit_tree_stress, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that the best fit tree stays balanced and in sync with the free lists.
+     */
+    void *ptrs[200] = {0};
+    unsigned int seed = 1;
+    for (int i = 0; i < 5000; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % 200;
+        if (ptrs[slot] != NULL) {
+            dy_free(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            // Mostly large sizes with some small ones keeping blocks apart
+            size_t size = (seed >> 16) % 4 == 0 ? 40 : 1024 + (seed >> 12) % 6000;
+            ptrs[slot] = dy_malloc(size);
+            cr_assert_not_null(ptrs[slot], "dy_malloc(%ld) failed", size);
+        }
+        if (i % 50 == 0) {
+            assert_tree_valid();
+        }
+    }
+    for (int i = 0; i < 200; i++) {
+        if (ptrs[i] != NULL)
+            dy_free(ptrs[i]);
+    }
+    assert_tree_valid();
+}
+
+Test(dyma_suite, mallopt_tree_threshold, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test setting the tree threshold.
+     */
+    cr_assert(dy_mallopt(DY_OPT_TREE_THRESHOLD, 8) == -1, "dy_mallopt accepted a threshold below a tree node");
+    cr_assert(dy_errno == EINVAL, "dy_errno is not EINVAL!");
+    dy_errno = 0;
+    cr_assert(dy_mallopt(DY_OPT_TREE_THRESHOLD, 0) == 0, "dy_mallopt(DY_OPT_TREE_THRESHOLD, 0) failed");
+
+    // With the tree disabled, nothing is indexed
+    void *x = dy_malloc(5000);
+    void *y = dy_malloc(32);
+    dy_free(x);
+    cr_assert_null(get_thread_arena()->tree_root, "Tree is not empty with the tree disabled");
+    dy_free(y);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+// Allocate and free blocks of mixed sizes in a random order, then check the heap
+static void exercise_placement() {
+    void *ptrs[64] = { NULL };
+    unsigned int seed = 7;
+    for (int i = 0; i < 2000; i++) {
+        int slot = rand_r(&seed) % 64;
+        if (ptrs[slot] != NULL) {
+            dy_free(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            ptrs[slot] = dy_malloc(200 + rand_r(&seed) % 600);
+            cr_assert_not_null(ptrs[slot], "dy_malloc failed");
+        }
+    }
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+    for (int i = 0; i < 64; i++) {
+        if (ptrs[i] != NULL) {
+            dy_free(ptrs[i]);
+        }
+    }
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, mallopt_placement, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that only known placement policies and a positive number of candidates are accepted.
+     */
+    cr_assert(dy_mallopt(DY_OPT_PLACEMENT, DY_PLACE_BEST_OF_N + 1) == -1, "dy_mallopt accepted an unknown policy");
+    cr_assert(dy_errno == EINVAL, "dy_errno is not EINVAL!");
+    cr_assert(dy_mallopt(DY_OPT_FIT_CANDIDATES, 0) == -1, "dy_mallopt accepted zero candidates");
+    dy_errno = 0;
+    cr_assert(dy_mallopt(DY_OPT_PLACEMENT, DY_PLACE_NEXT_FIT) == 0, "dy_mallopt(DY_OPT_PLACEMENT) failed");
+    cr_assert(dy_mallopt(DY_OPT_FIT_CANDIDATES, 2) == 0, "dy_mallopt(DY_OPT_FIT_CANDIDATES) failed");
+    void *x = dy_malloc(100);
+    cr_assert(get_thread_arena()->placement == DY_PLACE_NEXT_FIT, "Policy not copied to the arena");
+    cr_assert(get_thread_arena()->fit_candidates == 2, "Candidates not copied to the arena");
+    dy_free(x);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+#ifndef DY_TLSF
+// TLSF takes the first block of a list whose blocks all fit without scanning, so there is no rover to follow
+Test(dyma_suite, placement_next_fit, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that next fit resumes scanning where the last scan of the free list stopped.
+     */
+    cr_assert(dy_mallopt(DY_OPT_PLACEMENT, DY_PLACE_NEXT_FIT) == 0, "dy_mallopt failed");
+    // Blocks of 312, 408 and 312 bytes, kept apart so they are not coalesced (all in the same free list)
+    void *a = dy_malloc(300);
+    void *s1 = dy_malloc(32);
+    void *b = dy_malloc(400);
+    void *s2 = dy_malloc(32);
+    void *c = dy_malloc(300);
+    void *s3 = dy_malloc(32);
+    void *e = dy_malloc(300);
+    void *s4 = dy_malloc(32);
+    dy_free(a);
+    dy_free(b);
+    dy_free(c);
+
+    // The list is c, b, a: taking b leaves the rover on a
+    cr_assert(dy_malloc(400) == b, "Next fit did not take the first fitting block");
+    // e is freed to the head of the list, but the scan resumes at a (first fit would take e)
+    dy_free(e);
+    cr_assert(dy_malloc(300) == a, "Next fit did not resume at the rover");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+
+    dy_free(s1);
+    dy_free(s2);
+    dy_free(s3);
+    dy_free(s4);
+    exercise_placement();
+}
+#endif
+
+Test(dyma_suite, placement_address_fit, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that address-ordered first fit keeps free lists sorted and takes the lowest fitting block.
+     */
+    cr_assert(dy_mallopt(DY_OPT_PLACEMENT, DY_PLACE_ADDRESS_FIT) == 0, "dy_mallopt failed");
+    void *a = dy_malloc(300);
+    void *s1 = dy_malloc(32);
+    void *b = dy_malloc(400);
+    void *s2 = dy_malloc(32);
+    void *c = dy_malloc(300);
+    void *s3 = dy_malloc(32);
+    dy_free(c);
+    dy_free(b);
+    dy_free(a);
+    dy_free(s1);
+    cr_assert_eq(dy_heap_check(), 0, "Free lists are not in address order");
+
+    // First fit would take the most recently freed block
+    void *x = dy_malloc(300);
+    cr_assert(x == a, "Address-ordered first fit did not take the lowest block");
+    dy_free(x);
+    dy_free(s2);
+    dy_free(s3);
+    exercise_placement();
+}
+
+Test(dyma_suite, placement_best_of_n, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that best of n takes the smallest of the fitting blocks it compares.
+     */
+    cr_assert(dy_mallopt(DY_OPT_PLACEMENT, DY_PLACE_BEST_OF_N) == 0, "dy_mallopt failed");
+    void *y = dy_malloc(300);
+    void *s1 = dy_malloc(32);
+    void *x = dy_malloc(490);
+    void *s2 = dy_malloc(32);
+    dy_free(y);
+    dy_free(x);
+
+    // The list is x (504 bytes) then y (312 bytes), first fit would split x
+    cr_assert(dy_malloc(300) == y, "Best of n did not take the smallest fitting block");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+    dy_free(y);
+    dy_free(s1);
+    dy_free(s2);
+    exercise_placement();
+}
+
+Test(dyma_suite, free_deferred_coalesce, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that deferred frees leave their neighbours alone until a batch of frees sweeps the heap.
+     */
+    cr_assert(dy_mallopt(DY_OPT_COALESCE_BATCH, 4) == 0, "dy_mallopt(DY_OPT_COALESCE_BATCH) failed");
+    size_t bs = calc_block_size(300);
+    void *ptrs[5];
+    for (int i = 0; i < 5; i++) {
+        ptrs[i] = dy_malloc(300);
+    }
+    size_t tail = PAGE_SZ - HEAP_OVERHEAD - 5 * bs;
+    cr_assert(get_thread_arena()->coalesce_batch == 4, "Batch not copied to the arena");
+
+    // Three neighbours stay apart
+    dy_free(ptrs[0]);
+    dy_free(ptrs[1]);
+    dy_free(ptrs[2]);
+    assert_free_block_count(0, 4);
+    assert_free_block_count(bs, 3);
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+
+    // The fourth free sweeps the heap
+    dy_free(ptrs[4]);
+    cr_assert(get_thread_arena()->deferred_frees == 0, "Heap was not swept");
+    assert_free_block_count(0, 2);
+    assert_free_block_count(3 * bs, 1);
+    assert_free_block_count(bs + tail, 1);
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+    dy_free(ptrs[3]);
+}
+
+Test(dyma_suite, malloc_deferred_coalesce, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that a request no free block fits sweeps the heap before growing it.
+     */
+    cr_assert(dy_mallopt(DY_OPT_COALESCE_BATCH, 100) == 0, "dy_mallopt(DY_OPT_COALESCE_BATCH) failed");
+    size_t bs = calc_block_size(300);
+    void *a = dy_malloc(300);
+    void *b = dy_malloc(300);
+    void *c = dy_malloc(300);
+    // Take the rest of the heap
+    void *d = dy_malloc(PAGE_SZ - HEAP_OVERHEAD - 3 * bs - HEADER_SIZE);
+    cr_assert(c != NULL && d != NULL, "dy_malloc failed");
+    assert_free_block_count(0, 0);
+
+    dy_free(a);
+    dy_free(b);
+    assert_free_block_count(bs, 2);
+    void *x = dy_malloc(2 * bs - HEADER_SIZE);
+    cr_assert(x == a, "Request was not served by the coalesced neighbours");
+    cr_assert(dy_mem_end() - dy_mem_start() == PAGE_SZ, "Heap grew instead of coalescing");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, malloc_deferred_coalesce_tree, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that a request for the best fit tree sweeps the heap before growing it when nothing in the tree fits.
+     */
+    cr_assert(dy_mallopt(DY_OPT_COALESCE_BATCH, 100) == 0, "dy_mallopt(DY_OPT_COALESCE_BATCH) failed");
+    // Blocks just over half the tree threshold, so that three of them fit even after a large prologue
+    size_t sz = dy_config.tree_threshold / 2;
+    size_t bs = calc_block_size(sz);
+    size_t space = PAGE_SZ - HEAP_OVERHEAD;
+    cr_assert(3 * bs + MIN_ALLOC_BLOCK_SIZE <= space, "Blocks do not fit in the first page of the heap");
+    void *a = dy_malloc(sz);
+    void *b = dy_malloc(sz);
+    void *c = dy_malloc(sz);
+    // Take the rest of the heap
+    void *d = dy_malloc(space - 3 * bs - HEADER_SIZE);
+    cr_assert(c != NULL && d != NULL, "dy_malloc failed");
+    assert_free_block_count(0, 0);
+
+    // Each freed block is below the tree threshold, but together they are above it
+    dy_free(a);
+    dy_free(b);
+    assert_free_block_count(bs, 2);
+    cr_assert(2 * bs >= get_thread_arena()->tree_threshold, "Merged blocks are not large enough for the tree");
+    void *x = dy_malloc(2 * bs - HEADER_SIZE);
+    cr_assert(x == a, "Request was not served by the coalesced neighbours");
+    cr_assert(dy_mem_end() - dy_mem_start() == PAGE_SZ, "Heap grew instead of coalescing");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, top_chunk, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that the free block at the end of the heap is only carved when no other free block fits,
+     * and that the last block merges back into it when freed.
+     */
+    size_t tail = 400;
+    void *a = dy_malloc(900);
+    void *s = dy_malloc(32);
+    void *fill = dy_malloc(PAGE_SZ - HEAP_OVERHEAD - calc_block_size(900) - calc_block_size(32) - tail - HEADER_SIZE);
+    cr_assert(a != NULL && s != NULL && fill != NULL, "dy_malloc failed");
+    dy_arena *arena = get_thread_arena();
+    dy_block *top = arena->top;
+    cr_assert(top != NULL && GET_SIZE(top) == tail, "The end of the heap is not the top chunk");
+
+    // The top chunk would fit, but the freed block is used first
+    dy_free(a);
+    void *b = dy_malloc(200);
+    cr_assert(b == a, "Request was not served by the freed block");
+    cr_assert(arena->top == top && GET_SIZE(top) == tail, "The top chunk was carved");
+
+    // Nothing else fits, so the heap grows into the top chunk
+    void *c = dy_malloc(800);
+    cr_assert(c == top->body.payload, "Request was not carved from the top chunk");
+    dy_free(c);
+    cr_assert(arena->top == top && GET_SIZE(top) == tail + PAGE_SZ, "Last block did not merge into the top chunk");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, trim_automatic, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that the heap shrinks back to the top pad once a burst of allocations is freed.
+     */
+    void *ptrs[512];
+    for (int i = 0; i < 512; i++) {
+        ptrs[i] = dy_malloc(1000);
+        cr_assert_not_null(ptrs[i], "dy_malloc(1000) failed");
+    }
+    dy_heap_stats before;
+    dy_stats(&before);
+    size_t peak = dy_mem_end() - dy_mem_start();
+    cr_assert(peak > PAGE_SZ + dy_config.trim_threshold + dy_config.top_pad, "Heap did not grow");
+
+    for (int i = 0; i < 512; i++) {
+        dy_free(ptrs[i]);
+    }
+    dy_heap_stats after;
+    dy_stats(&after);
+    size_t size = dy_mem_end() - dy_mem_start();
+    dy_block *top = get_thread_arena()->top;
+    cr_assert(size < peak, "Heap was not trimmed");
+    cr_assert(top != NULL && GET_SIZE(top) >= dy_config.top_pad && GET_SIZE(top) < dy_config.top_pad + PAGE_SZ,
+              "Top chunk was not trimmed to the top pad");
+    cr_assert(after.heap_bytes == before.heap_bytes - (peak - size), "Heap bytes did not go down (%zu, %zu)",
+              before.heap_bytes, after.heap_bytes);
+    cr_assert(get_thread_arena()->heap_bytes == size, "Arena heap bytes not updated");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+
+    // The heap grows again as usual
+    void *x = dy_malloc(size * 2);
+    cr_assert_not_null(x, "dy_malloc failed after trimming");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, trim_no_thrash, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that allocating and freeing a block just over the trim threshold doesn't shrink the heap every time.
+     */
+    size_t sz = dy_config.trim_threshold + 1024;
+    void *x = dy_malloc(sz);
+    cr_assert_not_null(x, "dy_malloc failed");
+    size_t size = dy_mem_end() - dy_mem_start();
+    for (int i = 0; i < 16; i++) {
+        dy_free(x);
+        cr_assert(dy_mem_end() - dy_mem_start() == size, "Heap was trimmed after free %d", i);
+        x = dy_malloc(sz);
+        cr_assert_not_null(x, "dy_malloc failed");
+        cr_assert(dy_mem_end() - dy_mem_start() == size, "Heap grew again after malloc %d", i);
+    }
+    dy_free(x);
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, trim_pad, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that dy_trim gives back all but the requested padding, after flushing the quick lists.
+     */
+    cr_assert(dy_mallopt(DY_OPT_TRIM_THRESHOLD, 0) == 0, "dy_mallopt(DY_OPT_TRIM_THRESHOLD) failed");
+    void *ptrs[128];
+    for (int i = 0; i < 128; i++) {
+        ptrs[i] = dy_malloc(i % 2 ? 1000 : 100);
+    }
+    size_t peak = dy_mem_end() - dy_mem_start();
+    for (int i = 0; i < 128; i++) {
+        dy_free(ptrs[i]);
+    }
+    cr_assert(dy_mem_end() - dy_mem_start() == (long)peak, "Heap was trimmed while trimming is disabled");
+
+    cr_assert(dy_trim(4 * PAGE_SZ) == 1, "dy_trim did not give anything back");
+    assert_quick_list_block_count(0, 0);
+    cr_assert(dy_mem_end() - dy_mem_start() == 5 * PAGE_SZ, "Heap does not end right after the padding");
+    dy_block *top = get_thread_arena()->top;
+    cr_assert(top == FIRST_BLOCK(dy_mem_start()) && GET_SIZE(top) >= 4 * PAGE_SZ, "Padding is not kept in the top chunk");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+
+    cr_assert(dy_trim(0) == 1, "dy_trim did not give anything back");
+    cr_assert(dy_mem_end() - dy_mem_start() == PAGE_SZ, "Heap was not trimmed to one page");
+    cr_assert(dy_trim(0) == 0, "dy_trim gave back memory twice");
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+}
+
+Test(dyma_suite, slab_malloc_free, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that small requests are served from slab pages, without per-object headers.
+     */
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, 16) == 0, "dy_mallopt(DY_OPT_SLAB_MAX) failed");
+    void *x = dy_malloc(16);
+    void *y = dy_malloc(16);
+    void *z = dy_malloc(12);
+    cr_assert(x != NULL && y != NULL && z != NULL, "dy_malloc failed");
+    cr_assert(dy_mem_heap_index(x) == DY_SLAB_HEAP, "x is not a slab object");
+    cr_assert(y - x == 16 && z - y == 16, "Slab objects are not packed");
+    cr_assert(SLAB_PAGE(x)->object_size == 16, "Wrong size class");
+    cr_assert(check_pointer(x) == 0, "check_pointer rejected a slab object");
+
+    // Larger requests still come from the arena
+    void *w = dy_malloc(17);
+    cr_assert(dy_mem_heap_index(w) == 0, "w is not in the heap");
+
+    // Freed objects are reused
+    dy_free(y);
+    cr_assert(check_pointer(y) == -1, "check_pointer accepted a freed slab object");
+    void *v = dy_malloc(10);
+    cr_assert(v == y, "Freed slab object was not reused");
+
+    dy_free(x);
+    dy_free(v);
+    dy_free(z);
+    dy_free(w);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, slab_invalid_pointer, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that check_pointer rejects pointers into slab pages that are not allocated objects.
+     */
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, 24) == 0, "dy_mallopt(DY_OPT_SLAB_MAX) failed");
+    void *x = dy_malloc(24);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(check_pointer(x + 8) == -1, "check_pointer accepted the inside of an object");
+    cr_assert(check_pointer(SLAB_PAGE(x)) == -1, "check_pointer accepted the page header");
+    cr_assert(check_pointer(x + 24) == -1, "check_pointer accepted an object that was never allocated");
+    cr_assert(check_pointer((void *)SLAB_PAGE(x) + PAGE_SZ + SLAB_OBJECTS_OFFSET) == -1,
+              "check_pointer accepted a page that is not in use");
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, SLAB_MAX_SIZE + 1) == -1, "dy_mallopt accepted a slab size that is too large");
+    dy_free(x);
+}
+
+Test(dyma_suite, slab_realloc, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test reallocating slab objects within and beyond their size class.
+     */
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, 64) == 0, "dy_mallopt(DY_OPT_SLAB_MAX) failed");
+    char *x = dy_malloc(20);
+    cr_assert_not_null(x, "x is NULL!");
+    for (int i = 0; i < 20; i++) {
+        x[i] = i;
+    }
+    cr_assert(dy_realloc(x, 24) == x, "Realloc within the size class moved the object");
+
+    x = dy_realloc(x, 200);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(dy_mem_heap_index(x) == 0, "Realloc beyond the slab sizes did not move to the heap");
+    for (int i = 0; i < 20; i++) {
+        cr_assert(x[i] == i, "Data was not preserved at %d", i);
+    }
+    dy_free(x);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, slab_pages_recycled, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that slab objects spill over to new pages, and that empty pages are reused.
+     */
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, 64) == 0, "dy_mallopt(DY_OPT_SLAB_MAX) failed");
+    static void *ptrs[1500];
+    for (int i = 0; i < 1500; i++) {
+        ptrs[i] = dy_malloc(8);
+        cr_assert_not_null(ptrs[i], "ptrs[%d] is NULL!", i);
+    }
+    void *slabEnd = dy_mem_heap_end(DY_SLAB_HEAP);
+    cr_assert(slabEnd - dy_mem_heap_start(DY_SLAB_HEAP) >= (long)(4 * PAGE_SZ), "Objects did not spill over to new pages");
+    for (int i = 0; i < 1500; i++) {
+        dy_free(ptrs[i]);
+    }
+
+    // Empty pages are reused by another size class without growing the slab heap
+    for (int i = 0; i < 100; i++) {
+        ptrs[i] = dy_malloc(64);
+        cr_assert_not_null(ptrs[i], "ptrs[%d] is NULL!", i);
+    }
+    cr_assert(dy_mem_heap_end(DY_SLAB_HEAP) == slabEnd, "Empty slab pages were not reused");
+    for (int i = 0; i < 100; i++) {
+        dy_free(ptrs[i]);
+    }
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, slab_multithreaded, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test concurrent slab allocations, including frees from a thread other than the allocator.
+     */
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, 64) == 0, "dy_mallopt(DY_OPT_SLAB_MAX) failed");
+    pthread_t threads[NUM_TEST_THREADS];
+    void *result;
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        cr_assert(pthread_create(&threads[i], NULL, thread_stress_allocate, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        cr_assert(result == NULL, "Thread %d saw a failed or corrupted allocation", i);
+    }
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        cr_assert(pthread_create(&threads[i], NULL, thread_stress_free, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        cr_assert(result == NULL, "Thread %d saw a corrupted allocation", i);
+    }
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, memalign_tiny, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test aligned allocations smaller than the minimum block size, at every alignment offset.
+     */
+    for (size_t align = 16; align <= 4096; align <<= 1) {
+        for (int i = 0; i < 8; i++) {
+            void *x = dy_malloc(8 * i + 1);
+            void *y = dy_memalign(1, align);
+            cr_assert_not_null(y, "dy_memalign(1, %ld) is NULL!", align);
+            cr_assert((uintptr_t)y % align == 0, "y is not aligned to %ld", align);
+            dy_free(y);
+            dy_free(x);
+        }
+    }
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, malloc_batch, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test allocating a batch of blocks carved out of one free block.
+     */
+    void *ptrs[100];
+    size_t n = dy_malloc_batch(40, 100, ptrs);
+    cr_assert(n == 100, "dy_malloc_batch allocated %ld blocks", n);
+    for (int i = 0; i < 100; i++) {
+        dy_block *bp = (dy_block *)((char *)ptrs[i] - HEADER_SIZE);
+        cr_assert(check_pointer(ptrs[i]) == 0, "check_pointer rejected block %d", i);
+        cr_assert(GET_SIZE(bp) == 48, "Block %d has size %ld", i, GET_SIZE(bp));
+        if (i > 0) {
+            cr_assert((char *)ptrs[i] - (char *)ptrs[i - 1] == 48, "Blocks %d and %d are not adjacent", i - 1, i);
+        }
+        memset(ptrs[i], i, 40);
+    }
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_SZ * 2 - 48 * 100 - HEAP_OVERHEAD, 1);
+
+    // Freeing them as a batch merges them back into a single free block, bypassing the quick lists
+    dy_free_batch(ptrs, 100);
+    assert_quick_list_block_count(0, 0);
+    assert_free_block_count(0, 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, free_batch_runs, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test freeing a shuffled batch with gaps, where only some blocks are adjacent.
+     */
+    void *ptrs[8];
+    for (int i = 0; i < 8; i++) {
+        ptrs[i] = dy_malloc(200);
+    }
+    // Free all but the fourth block, in reverse order
+    void *batch[7] = {ptrs[7], ptrs[6], ptrs[5], ptrs[4], ptrs[2], ptrs[1], ptrs[0]};
+    dy_free_batch(batch, 7);
+    cr_assert((uintptr_t)batch[0] < (uintptr_t)batch[6], "Batch was not sorted");
+    assert_free_block_count(208 * 3, 1);
+    assert_free_block_count(0, 2);
+
+    dy_free(ptrs[3]);
+    assert_free_block_count(0, 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, free_batch_mixed, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test freeing a batch that mixes runs of arena blocks with slab objects and large blocks.
+     */
+    cr_assert(dy_mallopt(DY_OPT_SLAB_MAX, 64) == 0, "dy_mallopt(DY_OPT_SLAB_MAX) failed");
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 1 << 16) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+    void *batch[6];
+    batch[0] = dy_malloc(200);
+    batch[1] = dy_malloc(200);
+    batch[2] = dy_malloc(32);
+    batch[3] = dy_malloc(48);
+    batch[4] = dy_malloc(1 << 17);
+    batch[5] = dy_malloc(1 << 18);
+    for (int i = 0; i < 6; i++) {
+        cr_assert_not_null(batch[i], "dy_malloc failed");
+    }
+    cr_assert(IS_SLAB_POINTER(batch[2]) && IS_SLAB_POINTER(batch[3]), "Small objects did not come from slabs");
+    cr_assert(dy_mem_heap_index(batch[4]) == -1, "Large block was allocated from a heap!");
+
+    dy_free_batch(batch, 6);
+    dy_heap_stats stats;
+    dy_stats(&stats);
+    cr_assert(stats.frees == 6, "Not every pointer was freed (%zu)", stats.frees);
+    cr_assert(stats.large_bytes == 0, "Large blocks were not unmapped");
+    assert_free_block_count(0, 1);
+    cr_assert_eq(dy_heap_check(), 0, "Heap is inconsistent");
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, free_batch_duplicate, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    /**
+     * Test that a pointer appearing twice in a batch aborts.
+     */
+    void *x = dy_malloc(100);
+    void *y = dy_malloc(100);
+    void *batch[3] = {x, y, x};
+    dy_free_batch(batch, 3);
+}
+
+Test(dyma_suite, malloc_batch_too_large, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test a batch that does not fit in one piece, falling back to separate blocks until memory runs out.
+     */
+    static void *ptrs[8];
+    size_t n = dy_malloc_batch(PAGE_SZ * 300, 8, ptrs);
+    cr_assert(n == 3, "dy_malloc_batch allocated %ld blocks", n);
+    cr_assert(dy_errno == ENOMEM, "dy_errno is not ENOMEM!");
+    dy_free_batch(ptrs, n);
+    assert_free_block_count(0, 1);
+}
+
+Test(dyma_suite, region_alloc_reset, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test bump allocating from a region, then resetting and destroying it.
+     */
+    dy_region *region = dy_region_create(1024);
+    cr_assert_not_null(region, "region is NULL!");
+    cr_assert_null(dy_region_alloc(region, 0), "Zero sized region allocation is not NULL");
+
+    char *first = dy_region_alloc(region, 10);
+    char *second = dy_region_alloc(region, 10);
+    cr_assert(first != NULL && second != NULL, "Region allocation failed");
+    cr_assert(second - first == 16, "Region allocations are not packed");
+    cr_assert((uintptr_t)second % ROW_SIZE == 0, "Region allocation is not aligned");
+
+    // Fill several chunks, plus an object too large to share a chunk
+    for (int i = 0; i < 200; i++) {
+        char *p = dy_region_alloc(region, 24);
+        cr_assert_not_null(p, "Region allocation %d failed", i);
+        memset(p, i, 24);
+    }
+    char *large = dy_region_alloc(region, 4000);
+    cr_assert_not_null(large, "Large region allocation failed");
+    memset(large, 0xff, 4000);
+
+    // Resetting keeps only the first chunk, which is reused from the start
+    dy_region_reset(region);
+    cr_assert(dy_region_alloc(region, 10) == first, "Reset region did not reuse its first chunk");
+
+    // Only the region itself is cached in a quick list, the chunks are coalesced again
+    dy_region_destroy(region);
+    assert_quick_list_block_count(0, 1);
+    assert_free_block_count(0, 1);
+    cr_assert(dy_errno == 0, "dy_errno is not zero!");
+}
+
+Test(dyma_suite, region_reset_large_only, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that resetting a region with a single chunk keeps that chunk and frees a large object's chunk.
+     */
+    dy_region *region = dy_region_create(4096);
+    cr_assert_not_null(region, "region is NULL!");
+    char *first = dy_region_alloc(region, 10);
+    dy_heap_stats before;
+    dy_stats(&before);
+    char *large = dy_region_alloc(region, 20000);
+    cr_assert(first != NULL && large != NULL, "Region allocation failed");
+
+    dy_region_reset(region);
+    cr_assert(dy_region_alloc(region, 10) == first, "Reset region did not keep its original chunk");
+    dy_heap_stats after;
+    dy_stats(&after);
+    cr_assert_eq(after.used_bytes, before.used_bytes, "Large object's chunk was kept (%zu bytes used, %zu before)",
+                 after.used_bytes, before.used_bytes);
+    dy_region_destroy(region);
+}
+
+Test(dyma_suite, quick_list_adaptive, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that a quick list grows when its flushed blocks keep being needed again,
+     * and shrinks when its blocks are never reused.
+     */
+    int index = calc_quick_list_index(32);
+    void *ptrs[30];
+
+    // Bursts of allocations and frees larger than the initial capacity
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 30; i++) {
+            ptrs[i] = dy_malloc(24);
+            cr_assert(ptrs[i] != NULL, "dy_malloc(24) == NULL");
+        }
+        for (int i = 0; i < 30; i++) {
+            dy_free(ptrs[i]);
+        }
+    }
+    dy_quick_stats *stats = &dy_quick_lists[index].stats;
+    cr_assert(dy_quick_lists[index].capacity >= 30, "Quick list did not grow (capacity=%d)", dy_quick_lists[index].capacity);
+    cr_assert_eq(stats->frees, 600, "Wrong number of frees (%zu)", stats->frees);
+    cr_assert_eq(stats->hits + stats->misses, 600, "Allocations not counted (hits=%zu, misses=%zu)", stats->hits, stats->misses);
+    cr_assert(stats->refills > 0 && stats->flushes > 0, "Refills or flushes not counted");
+
+    // Once grown, a whole burst fits without flushing
+    size_t flushes = stats->flushes;
+    for (int i = 0; i < 30; i++) {
+        ptrs[i] = dy_malloc(24);
+    }
+    for (int i = 0; i < 30; i++) {
+        dy_free(ptrs[i]);
+    }
+    cr_assert_eq(stats->flushes, flushes, "Quick list was flushed");
+    assert_quick_list_block_count(32, 30);
+
+    // Blocks that are only ever freed shrink the list back down
+    int cold = calc_quick_list_index(64);
+    void *blocks[QUICK_LIST_WINDOW * 4];
+    for (int i = 0; i < QUICK_LIST_WINDOW * 4; i++) {
+        blocks[i] = dy_malloc(56);
+    }
+    for (int i = 0; i < QUICK_LIST_WINDOW * 4; i++) {
+        dy_free(blocks[i]);
+    }
+    cr_assert_eq(dy_quick_lists[cold].capacity, QUICK_LIST_MIN, "Quick list did not shrink (capacity=%d)", dy_quick_lists[cold].capacity);
+}
+
+Test(dyma_suite, mallopt_quick_budget, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that quick lists don't grow past their initial capacity without a budget.
+     */
+    cr_assert_eq(dy_mallopt(DY_OPT_QUICK_BUDGET, 0), 0, "dy_mallopt failed");
+    int index = calc_quick_list_index(32);
+    void *ptrs[30];
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 30; i++) {
+            ptrs[i] = dy_malloc(24);
+        }
+        for (int i = 0; i < 30; i++) {
+            dy_free(ptrs[i]);
+        }
+    }
+    cr_assert(dy_quick_lists[index].capacity <= QUICK_LIST_MAX, "Quick list grew (capacity=%d)", dy_quick_lists[index].capacity);
+    cr_assert(dy_quick_lists[index].stats.flushes > 0, "Quick list was never flushed");
+}
+
+Test(dyma_suite, stats_counts, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that dy_stats agrees with the free lists, quick lists and operations performed.
+     */
+    void *ptrs[10];
+    for (int i = 0; i < 10; i++) {
+        ptrs[i] = dy_malloc(100 * (i + 1));
+    }
+    // Every other block is freed, the small ones go to quick lists
+    for (int i = 0; i < 10; i += 2) {
+        dy_free(ptrs[i]);
+    }
+    ptrs[1] = dy_realloc(ptrs[1], 3000);
+
+    dy_heap_stats stats;
+    dy_stats(&stats);
+    cr_assert_eq(stats.mallocs, 11, "Wrong number of mallocs (%zu)", stats.mallocs);
+    cr_assert_eq(stats.frees, 6, "Wrong number of frees (%zu)", stats.frees);
+    cr_assert_eq(stats.reallocs, 1, "Wrong number of reallocs (%zu)", stats.reallocs);
+
+    // Free lists, counted by hand
+    size_t freeBlocks = 0;
+    size_t freeBytes = 0;
+    size_t largest = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        size_t listBytes = 0;
+        dy_block *head = &dy_free_list_heads[i];
+        for (dy_block *bp = NEXT_FREE(get_thread_arena(), head); bp != head; bp = NEXT_FREE(get_thread_arena(), bp)) {
+            freeBlocks++;
+            listBytes += GET_SIZE(bp);
+            largest = GET_SIZE(bp) > largest ? GET_SIZE(bp) : largest;
+        }
+        cr_assert_eq(stats.free_list_bytes[i], listBytes, "Wrong number of bytes in free list %d", i);
+        freeBytes += listBytes;
+    }
+    dy_block *top = get_thread_arena()->top;
+    if (top != NULL) {
+        freeBlocks++;
+        freeBytes += GET_SIZE(top);
+        largest = GET_SIZE(top) > largest ? GET_SIZE(top) : largest;
+    }
+    cr_assert_eq(stats.free_blocks, freeBlocks, "Wrong number of free blocks (exp=%zu, found=%zu)", freeBlocks, stats.free_blocks);
+    cr_assert_eq(stats.free_bytes, freeBytes, "Wrong number of free bytes (exp=%zu, found=%zu)", freeBytes, stats.free_bytes);
+    cr_assert_eq(stats.largest_free_block, largest, "Wrong largest free block");
+    cr_assert(stats.fragmentation > 0 && stats.fragmentation < 1, "Fragmentation out of range (%f)", stats.fragmentation);
+
+    // Quick lists, only the block of size 100 is small enough for them
+    cr_assert_eq(stats.quick_blocks, 1, "Wrong number of quick list blocks (%zu)", stats.quick_blocks);
+    cr_assert_eq(stats.quick_list_blocks[calc_quick_list_index(calc_block_size(100))], 1, "Quick list block not counted");
+
+    // Everything in the heap is either free or used
+    size_t heapBytes = dy_mem_end() - dy_mem_start();
+    cr_assert_eq(stats.heap_bytes, heapBytes, "Wrong heap size");
+    cr_assert_eq(stats.used_bytes + stats.free_bytes, heapBytes, "Used and free bytes don't add up to the heap size");
+    cr_assert(stats.peak_used_bytes >= stats.used_bytes, "Peak is below the current usage");
+}
+
+Test(dyma_suite, stats_peak_and_large, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that the peak usage is kept after freeing, and that large blocks are counted.
+     */
+    cr_assert(dy_mallopt(DY_OPT_MMAP_THRESHOLD, 1 << 16) == 0, "dy_mallopt(DY_OPT_MMAP_THRESHOLD) failed");
+    void *x = dy_malloc(20000);
+    void *y = dy_malloc(1 << 20);
+    dy_heap_stats stats;
+    dy_stats(&stats);
+    cr_assert(stats.large_bytes >= 1 << 20, "Large block not counted (%zu)", stats.large_bytes);
+    size_t peak = stats.used_bytes;
+    cr_assert(peak >= 20000 + (1 << 20), "Used bytes too small (%zu)", peak);
+
+    dy_free(x);
+    dy_free(y);
+    dy_stats(&stats);
+    cr_assert_eq(stats.large_bytes, 0, "Large block still counted");
+    cr_assert(stats.used_bytes < 20000, "Used bytes not released (%zu)", stats.used_bytes);
+    cr_assert_eq(stats.peak_used_bytes, peak, "Peak changed (exp=%zu, found=%zu)", peak, stats.peak_used_bytes);
+    cr_assert_eq(stats.mallocs, stats.frees, "Mallocs and frees don't match");
+}
+
+// Sum the sizes of walked blocks by state
+static int sum_walked_blocks(void *ptr, size_t size, int state, void *arg) {
+    ((size_t *)arg)[state] += size;
+    return 0;
+}
+
+Test(dyma_suite, heap_check_walk, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that a heap in use passes the check and that walking it visits every block.
+     */
+    void *ptrs[20];
+    for (int i = 0; i < 20; i++) {
+        ptrs[i] = dy_malloc(50 * (i + 1));
+    }
+    for (int i = 0; i < 20; i += 3) {
+        dy_free(ptrs[i]);
+    }
+    ptrs[1] = dy_realloc(ptrs[1], 2000);
+    cr_assert_eq(dy_heap_check(), 0, "dy_heap_check failed on a valid heap");
+
+    size_t sizes[3] = {0};
+    cr_assert_eq(dy_heap_walk(sum_walked_blocks, sizes), 0, "dy_heap_walk was stopped");
+    dy_heap_stats stats;
+    dy_stats(&stats);
+    cr_assert_eq(sizes[DY_WALK_FREE], stats.free_bytes, "Walked free bytes don't match");
+    cr_assert_eq(sizes[DY_WALK_QUICK], stats.quick_bytes, "Walked quick list bytes don't match");
+    size_t heapBytes = dy_mem_end() - dy_mem_start();
+    cr_assert_eq(sizes[DY_WALK_FREE] + sizes[DY_WALK_ALLOCATED] + sizes[DY_WALK_QUICK], heapBytes - HEAP_OVERHEAD,
+                 "Walk did not cover the heap between the prologue and epilogue");
+}
+
+Test(dyma_suite, heap_check_corruption, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that the heap check catches a corrupted footer and prev_alloc bit.
+     */
+    void *x = dy_malloc(500);
+    void *y = dy_malloc(500);
+    void *z = dy_malloc(500);
+    dy_free(y);
+    cr_assert_eq(dy_heap_check(), 0, "dy_heap_check failed on a valid heap");
+
+    // Overflowing x into the header of y
+    dy_block *block = y - HEADER_SIZE;
+    dy_header header = block->header;
+    block->header &= ~(dy_header)PREV_BLOCK_ALLOCATED;
+    dy_errno = 0;
+    cr_assert_eq(dy_heap_check(), -1, "dy_heap_check missed a cleared prev_alloc bit");
+    cr_assert_eq(dy_errno, EFAULT, "dy_errno != EFAULT");
+    block->header = header;
+
+    // Underflowing z into the footer of y
+    *(dy_footer *)(z - HEADER_SIZE - FOOTER_SIZE) = 0;
+    cr_assert_eq(dy_heap_check(), -1, "dy_heap_check missed a corrupted footer");
+    (void)x;
+}
+
+// Read the totals line of a heap profile
+static void read_profile_totals(size_t totals[4]) {
+    FILE *out = tmpfile();
+    cr_assert_not_null(out, "tmpfile failed");
+    cr_assert_eq(dy_profile_dump(out), 0, "dy_profile_dump failed");
+    rewind(out);
+    size_t rate;
+    int fields = fscanf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                        &totals[0], &totals[1], &totals[2], &totals[3], &rate);
+    cr_assert_eq(fields, 5, "Malformed profile header");
+    cr_assert_eq(rate, 1, "Wrong sampling rate in profile");
+    fclose(out);
+}
+
+Test(dyma_suite, profile_sampling, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that with a sampling rate of one byte every allocation is tracked until it is freed.
+     */
+    cr_assert_eq(dy_mallopt(DY_OPT_PROFILE_RATE, 1), 0, "dy_mallopt failed");
+    // The first allocation starts the countdown
+    void *first = dy_malloc(8);
+
+    void *x = dy_malloc(100);
+    void *y = dy_malloc(2000);
+    void *z = dy_memalign(300, 256);
+    size_t totals[4];
+    read_profile_totals(totals);
+    cr_assert_eq(totals[0], 3, "Wrong number of live samples (%zu)", totals[0]);
+    cr_assert_eq(totals[1], 2400, "Wrong number of live bytes (%zu)", totals[1]);
+
+    // Frees, reallocations and the moves of dy_memalign are followed
+    dy_free(x);
+    dy_free(z);
+    y = dy_realloc(y, 3000);
+    read_profile_totals(totals);
+    cr_assert_eq(totals[0], 1, "Wrong number of live samples (%zu)", totals[0]);
+    cr_assert_eq(totals[1], 3000, "Wrong number of live bytes (%zu)", totals[1]);
+    cr_assert(totals[2] >= 3 && totals[3] >= 2400, "Cumulative allocations lost");
+
+    dy_free(y);
+    dy_free(first);
+    read_profile_totals(totals);
+    cr_assert_eq(totals[0], 0, "Samples still live after freeing everything");
+}
+
+Test(dyma_suite, trace_paths, .timeout = TEST_TIMEOUT) {
+    /**
+     * Test that tracepoints count the path serving each allocation and free, in builds that have them.
+     */
+    FILE *out = tmpfile();
+    cr_assert_not_null(out, "tmpfile failed");
+#ifndef DY_TRACE
+    cr_assert_eq(dy_trace_dump(out), -1, "dy_trace_dump succeeded without tracepoints");
+    cr_assert_eq(dy_errno, ENOSYS, "dy_errno not set to ENOSYS");
+#else
+    void *x = dy_malloc(100);
+    dy_free(x);
+    x = dy_malloc(100);
+    dy_free(x);
+    cr_assert_eq(dy_trace_dump(out), 0, "dy_trace_dump failed");
+
+    // The totals and paths of mallocs (slab, large, quick list, free list, heap) and frees (slab, large, quick list, free list)
+    size_t counts[11];
+    char line[128];
+    rewind(out);
+    for (int i = 0; i < 11; i++) {
+        cr_assert_not_null(fgets(line, sizeof(line), out), "Trace summary too short");
+        int fields = i == 0 || i == 6 ? sscanf(line, "%*s %zu", &counts[i]) : sscanf(line + 20, "%zu", &counts[i]);
+        cr_assert_eq(fields, 1, "Malformed trace summary line: %s", line);
+    }
+    cr_assert_eq(counts[0], 2, "Wrong number of traced mallocs (%zu)", counts[0]);
+    cr_assert_eq(counts[3], 1, "Reuse not served by the quick list");
+    cr_assert_eq(counts[4] + counts[5], 1, "First malloc not served by the free lists or the heap");
+    cr_assert_eq(counts[6], 2, "Wrong number of traced frees (%zu)", counts[6]);
+    cr_assert_eq(counts[9], 2, "Frees not served by the quick list");
+#endif
+    fclose(out);
+}